@@ -0,0 +1,243 @@
+/*
+ * AVL tree, the structure the S-tree header measures itself against.
+ *
+ * Every node stores the exact height of its subtree, and the tree is
+ * rebalanced on the way back up from each insertion and removal, so that
+ * the heights of the two children of any node never differ by more than
+ * one. This keeps lookups close to optimal (height below 1.44 log2(n)) at
+ * the price of touching every node on the path during updates.
+ *
+ * The implementation is recursive and keeps no parent pointers; the depth
+ * of the recursion is bounded by the height of the tree.
+ */
+
+#include <assert.h>
+#include <stddef.h> /* offsetof */
+#include <stdlib.h>
+
+#include "oset.h"
+
+struct avl_node {
+	struct avl_node *left, *right;
+	int height;
+};
+
+struct avl_root {
+	struct avl_node *root;
+};
+
+static inline int avl_height(struct avl_node *n)
+{
+	return n ? n->height : 0;
+}
+
+static inline void avl_fix_height(struct avl_node *n)
+{
+	int l = avl_height(n->left), r = avl_height(n->right);
+
+	n->height = (l > r ? l : r) + 1;
+}
+
+/* left child becomes the root of the subtree */
+static inline struct avl_node *avl_rotate_right(struct avl_node *n)
+{
+	struct avl_node *l = n->left;
+
+	n->left = l->right;
+	l->right = n;
+	avl_fix_height(n);
+	avl_fix_height(l);
+	return l;
+}
+
+/* right child becomes the root of the subtree */
+static inline struct avl_node *avl_rotate_left(struct avl_node *n)
+{
+	struct avl_node *r = n->right;
+
+	n->right = r->left;
+	r->left = n;
+	avl_fix_height(n);
+	avl_fix_height(r);
+	return r;
+}
+
+/*
+ * avl_balance restores the AVL property at n, assuming both subtrees are
+ * valid AVL trees whose heights differ by at most two, and returns the
+ * new root of the subtree.
+ */
+static struct avl_node *avl_balance(struct avl_node *n)
+{
+	int b = avl_height(n->left) - avl_height(n->right);
+
+	if (b > 1) {
+		/* left-right case needs a double rotation */
+		if (avl_height(n->left->left) < avl_height(n->left->right))
+			n->left = avl_rotate_left(n->left);
+		return avl_rotate_right(n);
+	}
+
+	if (b < -1) {
+		/* right-left case needs a double rotation */
+		if (avl_height(n->right->right) < avl_height(n->right->left))
+			n->right = avl_rotate_right(n->right);
+		return avl_rotate_left(n);
+	}
+
+	avl_fix_height(n);
+	return n;
+}
+
+/* detaches the leftmost node of n into *first */
+static struct avl_node *avl_remove_first(struct avl_node *n,
+	struct avl_node **first)
+{
+	if (!n->left) {
+		*first = n;
+		return n->right;
+	}
+
+	n->left = avl_remove_first(n->left, first);
+	return avl_balance(n);
+}
+
+/* Ordered-set engine */
+
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - (offsetof(type, member))))
+
+#define treeint_entry(ptr) container_of(ptr, struct treeint, avl_n)
+
+struct treeint {
+	int value;
+	struct avl_node avl_n;
+};
+
+static void *treeint_init(void)
+{
+	struct avl_root *tree = oset_calloc(sizeof(struct avl_root), 1);
+	assert(tree);
+	return tree;
+}
+
+static struct avl_node *__treeint_insert(struct avl_node *n, int a,
+	bool *added)
+{
+	if (!n) {
+		struct treeint *i = oset_calloc(sizeof(struct treeint), 1);
+		assert(i);
+		i->value = a;
+		i->avl_n.height = 1;
+		*added = true;
+		return &i->avl_n;
+	}
+
+	struct treeint *t = treeint_entry(n);
+	if (a < t->value)
+		n->left = __treeint_insert(n->left, a, added);
+	else if (a > t->value)
+		n->right = __treeint_insert(n->right, a, added);
+	else
+		return n;
+
+	return *added ? avl_balance(n) : n;
+}
+
+static bool treeint_insert(void *set, int a)
+{
+	struct avl_root *tree = set;
+	bool added = false;
+
+	tree->root = __treeint_insert(tree->root, a, &added);
+	return added;
+}
+
+static bool treeint_find(void *set, int a)
+{
+	struct avl_node *n = ((struct avl_root *) set)->root;
+	while (n) {
+		struct treeint *t = treeint_entry(n);
+		if (a == t->value)
+			return true;
+
+		if (a < t->value)
+			n = n->left;
+		else
+			n = n->right;
+	}
+
+	return false;
+}
+
+/*
+ * A removed node with a right subtree is replaced by the first node of
+ * that subtree, like in any BST; heights are then repaired bottom-up.
+ */
+static struct avl_node *__treeint_remove(struct avl_node *n, int a,
+	bool *removed)
+{
+	if (!n)
+		return NULL;
+
+	struct treeint *t = treeint_entry(n);
+	if (a < t->value) {
+		n->left = __treeint_remove(n->left, a, removed);
+	} else if (a > t->value) {
+		n->right = __treeint_remove(n->right, a, removed);
+	} else {
+		struct avl_node *l = n->left, *r = n->right, *least;
+
+		oset_free(t, sizeof(*t));
+		*removed = true;
+		if (!r)
+			return l;
+
+		r = avl_remove_first(r, &least);
+		least->left = l;
+		least->right = r;
+		return avl_balance(least);
+	}
+
+	return *removed ? avl_balance(n) : n;
+}
+
+static bool treeint_remove(void *set, int a)
+{
+	struct avl_root *tree = set;
+	bool removed = false;
+
+	tree->root = __treeint_remove(tree->root, a, &removed);
+	return removed;
+}
+
+static void __treeint_destroy(struct avl_node *n)
+{
+	if (n->left)
+		__treeint_destroy(n->left);
+
+	if (n->right)
+		__treeint_destroy(n->right);
+
+	oset_free(treeint_entry(n), sizeof(struct treeint));
+}
+
+static void treeint_destroy(void *set)
+{
+	struct avl_root *tree = set;
+
+	assert(tree);
+	if (tree->root)
+		__treeint_destroy(tree->root);
+
+	oset_free(tree, sizeof(*tree));
+}
+
+const struct oset_ops avl_oset_ops = {
+	.name = "avl",
+	.init = treeint_init,
+	.destroy = treeint_destroy,
+	.insert = treeint_insert,
+	.find = treeint_find,
+	.remove = treeint_remove,
+};
@@ -0,0 +1,427 @@
+/*
+ * Benchmark driver shared by all ordered-set engines.
+ *
+ * The engine is picked with -e; OSET_DEFAULT selects the one used when the
+ * flag is absent, which lets the build keep the historical stree and rbtest
+ * binaries (and the hyperfine command lines behind results/) working as
+ * thin aliases of this program.
+ */
+
+#include <err.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "oset.h"
+#include "perfev.h"
+#include "workload.h"
+
+#ifndef OSET_DEFAULT
+#define OSET_DEFAULT st_oset_ops
+#endif
+
+static const struct oset_ops *engines[] = {
+	&st_oset_ops,
+	&rb_oset_ops,
+	&avl_oset_ops,
+	&treap_oset_ops,
+	&skl_oset_ops,
+};
+
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static const struct oset_ops *engine_lookup(const char *name)
+{
+	for (size_t i = 0; i < NENGINES; i++)
+		if (!strcmp(engines[i]->name, name))
+			return engines[i];
+	return NULL;
+}
+
+enum phase {
+	PH_GENERATE,
+	PH_LOAD,
+	PH_RUN,
+	PH_DESTROY,
+	NPHASES
+};
+
+static const char *phase_names[] = {
+	[PH_GENERATE] = "generate",
+	[PH_LOAD] = "load",
+	[PH_RUN] = "run",
+	[PH_DESTROY] = "destroy",
+};
+
+static const char *op_names[] = {
+	[WL_INSERT] = "insert",
+	[WL_FIND] = "find",
+	[WL_REMOVE] = "remove",
+};
+
+#define NOPS (sizeof(op_names) / sizeof(op_names[0]))
+
+/* memory held by the set right after the load phase, plus process peaks */
+struct mem_report {
+	size_t keys;
+	struct oset_mem engine;
+	size_t heap_in_use;    /* arena bytes in use, chunk headers included */
+	size_t workload_bytes; /* pre-generated keys, part of the peak RSS */
+	long peak_rss_kb;      /* from getrusage(2) */
+	long vm_hwm_kb;        /* from /proc/self/status, -1 if unavailable */
+};
+
+struct report {
+	const char *engine;
+	const char *dist;
+	const char *mix;
+	size_t count, nops;
+	int seed;
+	uint64_t phase_ns[NPHASES];
+	struct hist *hists; /* one per operation type, NULL unless -l */
+	struct perfev_sample *counters; /* one per phase, NULL unless -p */
+	struct mem_report *mem; /* NULL unless -m */
+};
+
+static long proc_status_kb(const char *field)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	size_t len = strlen(field);
+	char line[256];
+	long kb = -1;
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, field, len) && line[len] == ':') {
+			kb = strtol(line + len + 1, NULL, 10);
+			break;
+		}
+	fclose(f);
+	return kb;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t phase_begin(const struct report *r,
+	struct perfev *pev)
+{
+	if (r->counters)
+		perfev_start(pev);
+	return now_ns();
+}
+
+static inline void phase_end(struct report *r, struct perfev *pev,
+	enum phase ph, uint64_t t)
+{
+	r->phase_ns[ph] = now_ns() - t;
+	if (r->counters)
+		perfev_stop(pev, &r->counters[ph]);
+}
+
+static inline void apply(const struct oset_ops *ops, void *set,
+	const struct wl_op *op)
+{
+	switch (op->type) {
+		case WL_INSERT:
+			ops->insert(set, op->key);
+			break;
+		case WL_FIND:
+			ops->find(set, op->key);
+			break;
+		case WL_REMOVE:
+			ops->remove(set, op->key);
+			break;
+	}
+}
+
+/*
+ * Phase times are wall-clock seconds, latencies are nanoseconds and
+ * include the cost of one clock_gettime() call.
+ */
+static void report_json(const struct report *r, FILE *f)
+{
+	fprintf(f,
+		"{\n"
+		"  \"engine\": \"%s\",\n"
+		"  \"dist\": \"%s\",\n"
+		"  \"mix\": \"%s\",\n"
+		"  \"n\": %zu,\n"
+		"  \"ops\": %zu,\n"
+		"  \"seed\": %d,\n"
+		"  \"phases\": {",
+		r->engine, r->dist, r->mix, r->count, r->nops, r->seed);
+	for (int i = 0; i < NPHASES; i++)
+		fprintf(f, "%s\"%s\": %.9f", i ? ", " : "", phase_names[i],
+			r->phase_ns[i] / 1e9);
+	fprintf(f, "}");
+
+	if (r->counters) {
+		/* per-op counts are per loaded key and per run operation */
+		size_t nops[NPHASES] = {[PH_LOAD] = r->count, [PH_RUN] = r->nops};
+
+		fprintf(f, ",\n  \"counters\": {");
+		for (int i = 0; i < NPHASES; i++) {
+			fprintf(f, "%s\n    \"%s\": ", i ? "," : "", phase_names[i]);
+			perfev_json(&r->counters[i], nops[i], f);
+		}
+		fprintf(f, "\n  }");
+	}
+
+	if (r->mem) {
+		const struct mem_report *m = r->mem;
+
+		fprintf(f,
+			",\n  \"memory\": {\"keys\": %zu, \"allocations\": %zu, "
+			"\"payload_bytes\": %zu, \"requested_bytes\": %zu, "
+			"\"usable_bytes\": %zu, \"allocator_overhead\": %zu, "
+			"\"bytes_per_key\": %.2f, \"heap_in_use\": %zu, "
+			"\"peak_usable_bytes\": %zu, \"workload_bytes\": %zu, "
+			"\"peak_rss_kb\": %ld, \"vm_hwm_kb\": %ld}",
+			m->keys, m->engine.allocs, m->keys * sizeof(int),
+			m->engine.requested, m->engine.usable,
+			m->engine.usable - m->engine.requested,
+			m->keys ? (double) m->engine.usable / m->keys : 0.0,
+			m->heap_in_use, m->engine.peak_usable, m->workload_bytes,
+			m->peak_rss_kb, m->vm_hwm_kb);
+	}
+
+	if (r->hists) {
+		fprintf(f, ",\n  \"latency\": {");
+		for (size_t i = 0; i < NOPS; i++) {
+			fprintf(f, "%s\n    \"%s\": ", i ? "," : "", op_names[i]);
+			hist_json(&r->hists[i], f);
+		}
+		fprintf(f, "\n  }");
+	}
+	fprintf(f, "\n}\n");
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: treebench [-glmp] [-d dist] [-e engine] [-j file] [-o ops] "
+		"[-w mix] count seed\n"
+		"\t-d\tKey distribution: uniform, sequential, reverse, zipf, "
+		"clustered\n"
+		"\t-e\tOrdered-set engine:");
+	for (size_t i = 0; i < NENGINES; i++)
+		fprintf(stderr, " %s", engines[i]->name);
+	fprintf(stderr,
+		"\n"
+		"\t-g\tWrite the final tree to tree.gv (rbtree only)\n"
+		"\t-j\tWrite phase timings as JSON to file, - for stdout\n"
+		"\t-l\tRecord per-operation latency histograms into the report\n"
+		"\t-m\tAccount for memory held by the set and the process\n"
+		"\t-p\tCapture hardware performance counters per phase\n"
+		"\t-o\tNumber of operations after loading, defaults to count\n"
+		"\t-w\tOperation mix: legacy, ycsb-a, ycsb-b, ycsb-c, delete,\n"
+		"\t\tor insert:find:remove percentages\n"
+		"Defaults are uniform keys, the legacy mix and the %s engine\n",
+		OSET_DEFAULT.name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const struct oset_ops *ops = &OSET_DEFAULT;
+	enum wl_dist dist = WL_UNIFORM;
+	struct wl_mix mix;
+	bool opt_graph = false;
+	bool opt_latency = false;
+	bool opt_perf = false;
+	bool opt_mem = false;
+	const char *opt_json = NULL;
+	long nops = -1;
+	int ch;
+	char *ep;
+
+	wl_parse_mix("legacy", &mix);
+	while ((ch = getopt(argc, argv, "d:e:gj:lmo:pw:")) != -1) {
+		switch (ch) {
+			case 'd':
+				if (wl_parse_dist(optarg, &dist) != 0) {
+					warnx("unknown distribution -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'e':
+				if ((ops = engine_lookup(optarg)) == NULL) {
+					warnx("unknown engine -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'g':
+				opt_graph = true;
+				break;
+			case 'j':
+				opt_json = optarg;
+				break;
+			case 'l':
+				opt_latency = true;
+				break;
+			case 'm':
+				opt_mem = true;
+				break;
+			case 'o':
+				nops = strtol(optarg, &ep, 10);
+				if (nops < 0 || *ep != '\0') {
+					warnx("illegal number, -o argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'p':
+				opt_perf = true;
+				break;
+			case 'w':
+				if (wl_parse_mix(optarg, &mix) != 0) {
+					warnx("unknown mix -- %s", optarg);
+					usage();
+				}
+				break;
+			case '?':
+			default:
+				usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		usage();
+
+	if (opt_graph && !ops->dump)
+		errx(1, "engine %s cannot dump its tree", ops->name);
+
+	int ncount = atoi(argv[0]);
+	int seed = atoi(argv[1]);
+	struct workload w;
+	struct report r = {
+		.engine = ops->name,
+		.dist = wl_dist_name(dist),
+		.mix = mix.name,
+		.seed = seed,
+	};
+	struct perfev pev;
+	struct mallinfo2 heap_before;
+	size_t keys = 0;
+	uint64_t t;
+
+	if (ncount < 0)
+		usage();
+	if (nops < 0)
+		nops = ncount;
+
+	if (opt_latency && (r.hists = calloc(NOPS, sizeof(struct hist))) == NULL)
+		err(1, "calloc");
+
+	if (opt_perf) {
+		if (perfev_open(&pev) == 0)
+			warnx("no performance counters available");
+		if ((r.counters = calloc(NPHASES, sizeof(*r.counters))) == NULL)
+			err(1, "calloc");
+	}
+
+	t = phase_begin(&r, &pev);
+	wl_generate(&w, ncount, nops, dist, &mix, seed);
+	r.count = w.nload;
+	r.nops = w.nops;
+	phase_end(&r, &pev, PH_GENERATE, t);
+
+	if (opt_mem) {
+		if ((r.mem = calloc(1, sizeof(*r.mem))) == NULL)
+			err(1, "calloc");
+		r.mem->workload_bytes = w.nload * sizeof(*w.load) +
+			w.nops * sizeof(*w.ops);
+		heap_before = mallinfo2();
+		oset_mem_tracking = true;
+	}
+
+	void *set = ops->init();
+
+	t = phase_begin(&r, &pev);
+	if (r.hists) {
+		for (size_t i = 0; i < w.nload; ++i) {
+			uint64_t t0 = now_ns();
+			keys += ops->insert(set, w.load[i]);
+			hist_record(&r.hists[WL_INSERT], now_ns() - t0);
+		}
+	} else {
+		for (size_t i = 0; i < w.nload; ++i)
+			keys += ops->insert(set, w.load[i]);
+	}
+	phase_end(&r, &pev, PH_LOAD, t);
+
+	if (r.mem) {
+		r.mem->keys = keys;
+		r.mem->engine = oset_mem;
+		r.mem->heap_in_use = mallinfo2().uordblks - heap_before.uordblks;
+	}
+
+	t = phase_begin(&r, &pev);
+	if (r.hists) {
+		for (size_t i = 0; i < w.nops; ++i) {
+			uint64_t t0 = now_ns();
+			apply(ops, set, &w.ops[i]);
+			hist_record(&r.hists[w.ops[i].type], now_ns() - t0);
+		}
+	} else {
+		for (size_t i = 0; i < w.nops; ++i)
+			apply(ops, set, &w.ops[i]);
+	}
+	phase_end(&r, &pev, PH_RUN, t);
+
+	if (opt_graph) {
+		FILE *f = fopen("tree.gv", "w");
+		if (!f)
+			err(1, "tree.gv");
+		ops->dump(set, f);
+		fclose(f);
+	}
+
+	t = phase_begin(&r, &pev);
+	ops->destroy(set);
+	phase_end(&r, &pev, PH_DESTROY, t);
+
+	if (r.mem) {
+		struct rusage ru;
+
+		getrusage(RUSAGE_SELF, &ru);
+		r.mem->engine.peak_usable = oset_mem.peak_usable;
+		r.mem->peak_rss_kb = ru.ru_maxrss;
+		r.mem->vm_hwm_kb = proc_status_kb("VmHWM");
+	}
+
+	wl_free(&w);
+
+	if (opt_json && strcmp(opt_json, "-")) {
+		FILE *f = fopen(opt_json, "w");
+		if (!f)
+			err(1, "%s", opt_json);
+		report_json(&r, f);
+		fclose(f);
+	} else if (opt_json || opt_latency || opt_perf || opt_mem) {
+		report_json(&r, stdout);
+	}
+
+	if (opt_perf)
+		perfev_close(&pev);
+	free(r.mem);
+	free(r.counters);
+	free(r.hists);
+	return 0;
+}
@@ -2,9 +2,12 @@
 
 """
 command: hyperfine --warmup 20 -L n 100000,200000,300000,400000,500000,600000,700000,800000,900000,1000000,2000000,3000000,4000000,5000000,6000000,7000000,8000000,9000000,10000000 --export-markdown out.md --export-json out.json './rbtest {n} 1337' './stree {n} 1337'
+latency: for n in <same list>; do for b in rbtest stree; do ./$b -l -j results/lat-$b-$n.json $n 1337; done; done
+memory: for n in <same list>; do for b in rbtest stree; do ./$b -m -j results/mem-$b-$n.json $n 1337; done; done
 compile flags: -O2
 """
 
+import glob
 import json
 import os
 
@@ -30,3 +33,46 @@ for cmd in items:
         for row in items[cmd]:
             f.write(f"\t{row['n']}\t{row['mean']}\t{row['min']}\t{row['max']}\n")
 
+
+
+def load_reports(prefix, key):
+    """in-process reports written by -j, named <prefix>-<cmd>-<n>.json"""
+    reports = {}
+    for path in glob.glob(os.path.join("results", prefix + "-*-*.json")):
+        cmd = os.path.basename(path)[len(prefix) + 1:].rsplit("-", 1)[0]
+        with open(path) as f:
+            report = json.load(f)
+        if key not in report:
+            continue
+        if cmd not in reports:
+            reports[cmd] = []
+        reports[cmd].append(report)
+    return reports
+
+
+OPS = ("insert", "find", "remove")
+STATS = ("mean", "p50", "p99", "p99.9", "max")
+
+latency = load_reports("lat", "latency")
+for cmd in latency:
+    with open(os.path.join("results", cmd + "-lat.dat"), "w") as f:
+        f.write("# " + cmd + " latency (ns)\n")
+        f.write("#\tn\t" + "\t".join(op + "_" + s for op in OPS for s in STATS) + "\n")
+        for report in sorted(latency[cmd], key=lambda r: r["n"]):
+            cols = []
+            for op in OPS:
+                h = report["latency"][op]
+                cols += [str(h[s]) if h["count"] else "NaN" for s in STATS]
+            f.write(f"\t{report['n']}\t" + "\t".join(cols) + "\n")
+
+MEM = ("keys", "requested_bytes", "usable_bytes", "allocator_overhead",
+       "bytes_per_key", "heap_in_use", "peak_rss_kb")
+
+memory = load_reports("mem", "memory")
+for cmd in memory:
+    with open(os.path.join("results", cmd + "-mem.dat"), "w") as f:
+        f.write("# " + cmd + " memory after loading\n")
+        f.write("#\tn\t" + "\t".join(MEM) + "\n")
+        for report in sorted(memory[cmd], key=lambda r: r["n"]):
+            m = report["memory"]
+            f.write(f"\t{report['n']}\t" + "\t".join(str(m[k]) for k in MEM) + "\n")
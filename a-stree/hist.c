@@ -0,0 +1,51 @@
+#include "hist.h"
+
+#include <inttypes.h>
+
+/* largest value that maps to bucket i */
+static uint64_t hist_bucket_max(unsigned i)
+{
+	if (i < 2 * HIST_SUB)
+		return i;
+
+	unsigned shift = i / HIST_SUB - 1;
+	uint64_t top = i - shift * HIST_SUB;
+	return ((top + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	if (h->count == 0)
+		return 0;
+
+	/* rank of the sample we are looking for, 1-based */
+	uint64_t rank = p / 100 * h->count + 0.5;
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < HIST_NBUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			uint64_t v = hist_bucket_max(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+void hist_json(const struct hist *h, FILE *f)
+{
+	fprintf(f,
+		"{\"count\": %" PRIu64 ", \"mean\": %.1f, \"min\": %" PRIu64
+		", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64
+		", \"p99.9\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+		h->count,
+		h->count ? (double) h->sum / h->count : 0.0,
+		h->min,
+		hist_percentile(h, 50),
+		hist_percentile(h, 90),
+		hist_percentile(h, 99),
+		hist_percentile(h, 99.9),
+		h->max);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-linear latency histogram in the spirit of HdrHistogram.
+ *
+ * Values below 2^HIST_SUB_BITS are counted exactly; above that every power
+ * of two is split into 2^HIST_SUB_BITS equal sub-buckets, which bounds the
+ * relative error of a reported percentile to about 3%. The whole uint64_t
+ * range fits in 1920 buckets, so recording is a clz, a shift and an
+ * increment.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_NBUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min, max;
+	uint64_t buckets[HIST_NBUCKETS];
+};
+
+static inline unsigned hist_index(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return v;
+
+	unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (v >> shift);
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->buckets[hist_index(v)]++;
+}
+
+/* highest value equivalent to the bucket holding the p-th percentile */
+uint64_t hist_percentile(const struct hist *h, double p);
+
+/* writes count, mean, min, p50, p90, p99, p99.9 and max as a JSON object */
+void hist_json(const struct hist *h, FILE *f);
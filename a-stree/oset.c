@@ -0,0 +1,4 @@
+#include "oset.h"
+
+bool oset_mem_tracking;
+struct oset_mem oset_mem;
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <malloc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Ordered-set interface shared by every tree engine in this directory so
+ * that one driver can benchmark them head to head. Each engine keeps its
+ * own intrusive node type and struct treeint container; only this table
+ * of operations is visible to the driver.
+ *
+ * Keys are plain ints, as in the original treeint test programs, and
+ * duplicate keys are never inserted.
+ */
+struct oset_ops {
+	const char *name;
+	void *(*init)(void);
+	void (*destroy)(void *set);
+	/* true if the key was absent and has been added */
+	bool (*insert)(void *set, int key);
+	bool (*find)(void *set, int key);
+	/* true if the key was present and has been removed */
+	bool (*remove)(void *set, int key);
+	/* optional, writes the tree in graphviz format */
+	void (*dump)(void *set, FILE *f);
+};
+
+extern const struct oset_ops st_oset_ops;
+extern const struct oset_ops rb_oset_ops;
+extern const struct oset_ops avl_oset_ops;
+extern const struct oset_ops treap_oset_ops;
+extern const struct oset_ops skl_oset_ops;
+
+/*
+ * Engines allocate their nodes and roots through oset_calloc() and
+ * oset_free(), which keep a running account of what they hold when
+ * oset_mem_tracking is set. The requested size is what the engine asked
+ * for; the usable size is what malloc actually reserved for it, so the
+ * difference is the allocator's rounding overhead. Per-chunk headers are
+ * visible only in the arena totals the driver samples separately.
+ */
+struct oset_mem {
+	size_t allocs;    /* live allocations */
+	size_t requested; /* bytes asked for */
+	size_t usable;    /* bytes reserved, see malloc_usable_size(3) */
+	size_t peak_usable;
+};
+
+extern bool oset_mem_tracking;
+extern struct oset_mem oset_mem;
+
+static inline void *oset_calloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+
+	if (oset_mem_tracking && p) {
+		oset_mem.allocs++;
+		oset_mem.requested += nmemb * size;
+		oset_mem.usable += malloc_usable_size(p);
+		if (oset_mem.usable > oset_mem.peak_usable)
+			oset_mem.peak_usable = oset_mem.usable;
+	}
+	return p;
+}
+
+/* size must be the size originally passed to oset_calloc() */
+static inline void oset_free(void *p, size_t size)
+{
+	if (oset_mem_tracking && p) {
+		oset_mem.allocs--;
+		oset_mem.requested -= size;
+		oset_mem.usable -= malloc_usable_size(p);
+	}
+	free(p);
+}
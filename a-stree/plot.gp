@@ -10,3 +10,61 @@ plot \
     '' using 1:2 with lines title "rbtree", \
 "results/stree.dat" using 1:2:3:4 with yerrorbars title "", \
     '' using 1:2 with lines title "stree"
+
+# per-operation tails from the -l reports; columns are n, then
+# mean/p50/p99/p99.9/max for insert (2-6), find (7-11) and remove (12-16)
+reset
+set terminal png size 1280,480
+set output 'results/tail.png'
+set multiplot layout 1,2 title 'rbtree vs stree, per-operation latency'
+set xlabel 'number of int'
+set ylabel 'latency (ns)'
+set logscale y
+set key top left
+
+set title 'insert'
+plot \
+"results/rbtest-lat.dat" using 1:2 with lines dt 2 lc 1 title "rbtree mean", \
+    '' using 1:4 with lines lc 1 title "rbtree p99", \
+    '' using 1:5 with lines dt 3 lc 1 title "rbtree p99.9", \
+"results/stree-lat.dat" using 1:2 with lines dt 2 lc 2 title "stree mean", \
+    '' using 1:4 with lines lc 2 title "stree p99", \
+    '' using 1:5 with lines dt 3 lc 2 title "stree p99.9"
+
+set title 'remove'
+plot \
+"results/rbtest-lat.dat" using 1:12 with lines dt 2 lc 1 title "rbtree mean", \
+    '' using 1:14 with lines lc 1 title "rbtree p99", \
+    '' using 1:15 with lines dt 3 lc 1 title "rbtree p99.9", \
+"results/stree-lat.dat" using 1:12 with lines dt 2 lc 2 title "stree mean", \
+    '' using 1:14 with lines lc 2 title "stree p99", \
+    '' using 1:15 with lines dt 3 lc 2 title "stree p99.9"
+
+unset multiplot
+
+# memory next to time; -mem.dat columns are n, keys, requested, usable,
+# allocator overhead, bytes per key, heap in use and peak RSS in KiB
+reset
+set terminal png size 1280,480
+set output 'results/memory.png'
+set multiplot layout 1,2 title 'rbtree vs stree, time and memory'
+set xlabel 'number of int'
+
+set title 'time'
+set ylabel 'mean time (s)'
+plot \
+"results/rbtest.dat" using 1:2 with lines lc 1 title "rbtree", \
+"results/stree.dat" using 1:2 with lines lc 2 title "stree"
+
+set title 'memory'
+set ylabel 'MiB'
+set key top left
+plot \
+"results/rbtest-mem.dat" using 1:($4 / 1048576) with lines lc 1 title "rbtree usable", \
+    '' using 1:($3 / 1048576) with lines dt 2 lc 1 title "rbtree requested", \
+    '' using 1:($8 / 1024) with lines dt 3 lc 1 title "rbtree peak RSS", \
+"results/stree-mem.dat" using 1:($4 / 1048576) with lines lc 2 title "stree usable", \
+    '' using 1:($3 / 1048576) with lines dt 2 lc 2 title "stree requested", \
+    '' using 1:($8 / 1024) with lines dt 3 lc 2 title "stree peak RSS"
+
+unset multiplot
@@ -4,38 +4,36 @@
 #include <stddef.h> /* offsetof */
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+
+#include "oset.h"
 
 #define container_of(ptr, type, member) \
     ((type *) ((char *) (ptr) - (offsetof(type, member))))
 
 #define treeint_entry(ptr) container_of(ptr, struct treeint, st_n)
 
-#define max(x, y) (x > y) ? (x) : (y)
-
 struct treeint {
 	int value;
 	struct rb_node st_n;
 };
 
-static struct rb_root *tree = {NULL};
-
-int treeint_init(void)
+static void *treeint_init(void)
 {
-	tree = calloc(sizeof(struct rb_root), 1);
+	struct rb_root *tree = oset_calloc(sizeof(struct rb_root), 1);
 	assert(tree);
-	return 0;
+	return tree;
 }
 
-struct treeint *treeint_insert(int a)
+static bool treeint_insert(void *set, int a)
 {
+	struct rb_root *tree = set;
 	struct rb_node **new = &(tree->rb_node), *parent = NULL;
 	while (*new) {
 		struct treeint *t = container_of(*new, struct treeint, st_n);
 		// this means we do not insert if an existing node with the
 		// same value exists
 		if (a == t->value)
-			return t;
+			return false;
 		parent = *new;
 		if (a < t->value)
 			new = &((*new)->rb_left);
@@ -43,14 +41,15 @@ struct treeint *treeint_insert(int a)
 			new = &((*new)->rb_right);
 	}
 	// Q: why calloc instead of malloc?
-	struct treeint *i = calloc(sizeof(struct treeint), 1);
+	struct treeint *i = oset_calloc(sizeof(struct treeint), 1);
+	assert(i);
 	i->value = a;
 	rb_link_node(&i->st_n, parent, new);
 	rb_insert_color(&i->st_n, tree);
-	return i;
+	return true;
 }
 
-struct treeint *treeint_find(int a)
+static struct treeint *__treeint_find(struct rb_root *tree, int a)
 {
 	struct rb_node *n = tree->rb_node;
 	while (n) {
@@ -67,37 +66,24 @@ struct treeint *treeint_find(int a)
 	return 0;
 }
 
-int treeint_remove(int a)
+static bool treeint_find(void *set, int a)
 {
-	struct treeint *n = treeint_find(a);
-	if (!n)
-		return -1;
-
-	rb_erase(&n->st_n, tree);
-	free(n);
-	return 0;
+	return __treeint_find(set, a) != NULL;
 }
 
-// Q: why static?
-static void __treeint_dump(struct rb_node *n, int depth)
+static bool treeint_remove(void *set, int a)
 {
+	struct rb_root *tree = set;
+	struct treeint *n = __treeint_find(tree, a);
 	if (!n)
-		return;
-
-	/* in-order traversal */
-	__treeint_dump(n->rb_left, depth + 1);
-
-	struct treeint *v = treeint_entry(n);
-	printf("%d\n", v->value);
-
-	__treeint_dump(n->rb_right, depth + 1);
-}
+		return false;
 
-void treeint_dump(void)
-{
-	__treeint_dump(tree->rb_node, 0);
+	rb_erase(&n->st_n, tree);
+	oset_free(n, sizeof(*n));
+	return true;
 }
 
+// Q: why static?
 static void __treeint_pretty_dump(struct rb_node *n, FILE *f)
 {
 	if (!n)
@@ -125,9 +111,10 @@ static void __treeint_pretty_dump(struct rb_node *n, FILE *f)
 	__treeint_pretty_dump(n->rb_right, f);
 }
 
-void treeint_pretty_dump(void)
+static void treeint_pretty_dump(void *set, FILE *f)
 {
-	FILE *f = fopen("tree.gv", "w");
+	struct rb_root *tree = set;
+
 	fprintf(f, "%s",
 		"graph{\n"
 		"  node [shape=circle, style=filled]\n");
@@ -139,7 +126,6 @@ void treeint_pretty_dump(void)
 	__treeint_pretty_dump(tree->rb_node, f);
 	fprintf(f, "%s",
 		"}\n");
-	fclose(f);
 }
 
 static void __treeint_destroy(struct rb_node *n)
@@ -151,35 +137,26 @@ static void __treeint_destroy(struct rb_node *n)
 		__treeint_destroy(n->rb_right);
 
 	struct treeint *i = treeint_entry(n);
-	free(i);
+	oset_free(i, sizeof(*i));
 }
 
-int treeint_destroy(void)
+static void treeint_destroy(void *set)
 {
+	struct rb_root *tree = set;
+
 	assert(tree);
 	if (tree->rb_node)
 		__treeint_destroy(tree->rb_node);
 
-	free(tree);
-	return 0;
+	oset_free(tree, sizeof(*tree));
 }
 
-int main(int argc, char **argv)
-{
-	int seed = atoi(argv[2]);
-	int ncount = atoi(argv[1]);
-
-	srand(seed);
-
-	treeint_init();
-
-	for (int i = 0; i < ncount; ++i)
-		treeint_insert(rand());
-
-	for (int i = 0; i < ncount; ++i)
-		treeint_remove(rand());
-
-	treeint_destroy();
-
-	return 0;
-}
+const struct oset_ops rb_oset_ops = {
+	.name = "rbtree",
+	.init = treeint_init,
+	.destroy = treeint_destroy,
+	.insert = treeint_insert,
+	.find = treeint_find,
+	.remove = treeint_remove,
+	.dump = treeint_pretty_dump,
+};
@@ -0,0 +1,166 @@
+/*
+ * Skip list: a sorted linked list with a random number of express lanes
+ * per node. A node reaches level k + 1 with probability 1/4 given that it
+ * reached level k, so lookups skip ahead roughly four nodes per step on
+ * every level and visit O(log n) nodes in expectation. There is no
+ * rebalancing at all; insertion and removal only splice pointers along
+ * the search path.
+ *
+ * Unlike the trees, nodes carry a variable number of forward pointers and
+ * are therefore not intrusive; the key is stored in the node itself.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "oset.h"
+
+#define SKL_MAX_LEVEL 16
+
+struct skl_node {
+	int value;
+	int level;
+	struct skl_node *next[];
+};
+
+struct skl_root {
+	int level;     /* highest level in use */
+	uint32_t seed; /* xorshift32 state for levels */
+	struct skl_node *head;
+};
+
+static inline int skl_random_level(struct skl_root *s)
+{
+	uint32_t x = s->seed;
+	int level = 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	s->seed = x;
+
+	/* two random bits per level, so the chance to climb is 1/4 */
+	while ((x & 3) == 0 && level < SKL_MAX_LEVEL) {
+		level++;
+		x >>= 2;
+	}
+	return level;
+}
+
+static inline size_t skl_size(int level)
+{
+	return sizeof(struct skl_node) + level * sizeof(struct skl_node *);
+}
+
+static struct skl_node *skl_alloc(int value, int level)
+{
+	struct skl_node *n = oset_calloc(1, skl_size(level));
+	assert(n);
+	n->value = value;
+	n->level = level;
+	return n;
+}
+
+/*
+ * skl_search fills update[] with the last node before a on every level
+ * and returns the first node not less than a on the bottom level.
+ */
+static inline struct skl_node *skl_search(struct skl_root *s, int a,
+	struct skl_node **update)
+{
+	struct skl_node *x = s->head;
+
+	for (int i = s->level - 1; i >= 0; i--) {
+		while (x->next[i] && x->next[i]->value < a)
+			x = x->next[i];
+		update[i] = x;
+	}
+	return x->next[0];
+}
+
+/* Ordered-set engine */
+
+static void *skl_init(void)
+{
+	struct skl_root *s = oset_calloc(sizeof(struct skl_root), 1);
+	assert(s);
+	s->level = 1;
+	s->seed = 2463534242u;
+	s->head = skl_alloc(0, SKL_MAX_LEVEL);
+	return s;
+}
+
+static bool skl_insert(void *set, int a)
+{
+	struct skl_root *s = set;
+	struct skl_node *update[SKL_MAX_LEVEL];
+	struct skl_node *x = skl_search(s, a, update);
+
+	if (x && x->value == a)
+		return false;
+
+	int level = skl_random_level(s);
+	for (; s->level < level; s->level++)
+		update[s->level] = s->head;
+
+	x = skl_alloc(a, level);
+	for (int i = 0; i < level; i++) {
+		x->next[i] = update[i]->next[i];
+		update[i]->next[i] = x;
+	}
+	return true;
+}
+
+static bool skl_find(void *set, int a)
+{
+	struct skl_root *s = set;
+	struct skl_node *x = s->head;
+
+	for (int i = s->level - 1; i >= 0; i--)
+		while (x->next[i] && x->next[i]->value < a)
+			x = x->next[i];
+
+	x = x->next[0];
+	return x && x->value == a;
+}
+
+static bool skl_remove(void *set, int a)
+{
+	struct skl_root *s = set;
+	struct skl_node *update[SKL_MAX_LEVEL];
+	struct skl_node *x = skl_search(s, a, update);
+
+	if (!x || x->value != a)
+		return false;
+
+	for (int i = 0; i < x->level; i++)
+		update[i]->next[i] = x->next[i];
+
+	while (s->level > 1 && !s->head->next[s->level - 1])
+		s->level--;
+
+	oset_free(x, skl_size(x->level));
+	return true;
+}
+
+static void skl_destroy(void *set)
+{
+	struct skl_root *s = set;
+
+	assert(s);
+	for (struct skl_node *x = s->head, *next; x; x = next) {
+		next = x->next[0];
+		oset_free(x, skl_size(x->level));
+	}
+	oset_free(s, sizeof(*s));
+}
+
+const struct oset_ops skl_oset_ops = {
+	.name = "skiplist",
+	.init = skl_init,
+	.destroy = skl_destroy,
+	.insert = skl_insert,
+	.find = skl_find,
+	.remove = skl_remove,
+};
@@ -295,13 +295,13 @@ void st_remove(struct st_node **root, struct st_node *del)
 	st_update(root, parent);
 }
 
-/* Test program */
+/* Ordered-set engine */
 
 #include <assert.h>
 #include <stddef.h> /* offsetof */
-#include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+
+#include "oset.h"
 
 #define container_of(ptr, type, member) \
     ((type *) ((char *) (ptr) - (offsetof(type, member))))
@@ -313,13 +313,11 @@ struct treeint {
 	struct st_node st_n;
 };
 
-static struct st_root *tree;
-
-int treeint_init()
+static void *treeint_init(void)
 {
-	tree = calloc(sizeof(struct st_root), 1);
+	struct st_root *tree = oset_calloc(sizeof(struct st_root), 1);
 	assert(tree);
-	return 0;
+	return tree;
 }
 
 static void __treeint_destroy(struct st_node *n)
@@ -331,29 +329,31 @@ static void __treeint_destroy(struct st_node *n)
 		__treeint_destroy(st_right(n));
 
 	struct treeint *i = treeint_entry(n);
-	free(i);
+	oset_free(i, sizeof(*i));
 }
 
-int treeint_destroy()
+static void treeint_destroy(void *set)
 {
+	struct st_root *tree = set;
+
 	assert(tree);
 	if (st_root(tree))
 		__treeint_destroy(st_root(tree));
 
-	free(tree);
-	return 0;
+	oset_free(tree, sizeof(*tree));
 }
 
-struct treeint *treeint_insert(int a)
+static bool treeint_insert(void *set, int a)
 {
+	struct st_root *tree = set;
 	struct st_node *p = NULL;
-	enum st_dir d;
+	enum st_dir d = LEFT;
 	// iterative traversal, p will be the root where we insert into
 	for (struct st_node *n = st_root(tree); n;) {
 		struct treeint *t = container_of(n, struct treeint, st_n);
 		// this means we do not insert if an existing node with the same value already exists
 		if (a == t->value)
-			return t;
+			return false;
 
 		p = n;
 
@@ -366,17 +366,18 @@ struct treeint *treeint_insert(int a)
 		}
 	}
 
-	struct treeint *i = calloc(sizeof(struct treeint), 1);
+	struct treeint *i = oset_calloc(sizeof(struct treeint), 1);
+	assert(i);
 	if (st_root(tree))
 		st_insert(&st_root(tree), p, &i->st_n, d);
 	else
 		st_root(tree) = &i->st_n;
 
 	i->value = a;
-	return i;
+	return true;
 }
 
-struct treeint *treeint_find(int a)
+static struct treeint *__treeint_find(struct st_root *tree, int a)
 {
 	struct st_node *n = st_root(tree);
 	while (n) {
@@ -393,52 +394,28 @@ struct treeint *treeint_find(int a)
 	return 0;
 }
 
-int treeint_remove(int a)
+static bool treeint_find(void *set, int a)
 {
-	struct treeint *n = treeint_find(a);
-	if (!n)
-		return -1;
-
-	st_remove(&st_root(tree), &n->st_n);
-	free(n);
-	return 0;
+	return __treeint_find(set, a) != NULL;
 }
 
-/* ascending order */
-static void __treeint_dump(struct st_node *n, int depth)
+static bool treeint_remove(void *set, int a)
 {
+	struct st_root *tree = set;
+	struct treeint *n = __treeint_find(tree, a);
 	if (!n)
-		return;
+		return false;
 
-	__treeint_dump(st_left(n), depth + 1);
-
-	struct treeint *v = treeint_entry(n);
-	printf("%d\n", v->value);
-
-	__treeint_dump(st_right(n), depth + 1);
-}
-
-void treeint_dump()
-{
-	__treeint_dump(st_root(tree), 0);
+	st_remove(&st_root(tree), &n->st_n);
+	oset_free(n, sizeof(*n));
+	return true;
 }
 
-int main(int argc, char **argv)
-{
-	int seed = atoi(argv[2]);
-	int ncount = atoi(argv[1]);
-
-	srand(seed);
-
-	treeint_init();
-
-	for (int i = 0; i < ncount; ++i)
-		treeint_insert(rand());
-
-	for (int i = 0; i < ncount; ++i)
-		treeint_remove(rand());
-
-	treeint_destroy();
-
-	return 0;
-}
+const struct oset_ops st_oset_ops = {
+	.name = "stree",
+	.init = treeint_init,
+	.destroy = treeint_destroy,
+	.insert = treeint_insert,
+	.find = treeint_find,
+	.remove = treeint_remove,
+};
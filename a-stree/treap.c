@@ -0,0 +1,202 @@
+/*
+ * Treap: a binary search tree on keys that is simultaneously a max-heap on
+ * random priorities drawn at insertion time. The expected shape equals
+ * that of a BST built from a random permutation of the keys, so the
+ * expected depth is O(log n) regardless of the insertion order, without
+ * any height or color bookkeeping.
+ *
+ * Insertion places the node as a leaf and rotates it up while its priority
+ * beats its parent's. Removal merges the two subtrees of the removed node
+ * by priority.
+ */
+
+#include <assert.h>
+#include <stddef.h> /* offsetof */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "oset.h"
+
+struct treap_node {
+	struct treap_node *left, *right;
+	uint32_t prio;
+};
+
+struct treap_root {
+	struct treap_node *root;
+	uint32_t seed; /* xorshift32 state for priorities */
+};
+
+static inline uint32_t treap_prio(struct treap_root *t)
+{
+	uint32_t x = t->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return t->seed = x;
+}
+
+/* left child becomes the root of the subtree */
+static inline struct treap_node *treap_rotate_right(struct treap_node *n)
+{
+	struct treap_node *l = n->left;
+
+	n->left = l->right;
+	l->right = n;
+	return l;
+}
+
+/* right child becomes the root of the subtree */
+static inline struct treap_node *treap_rotate_left(struct treap_node *n)
+{
+	struct treap_node *r = n->right;
+
+	n->right = r->left;
+	r->left = n;
+	return r;
+}
+
+/* every key in l is less than every key in r */
+static struct treap_node *treap_merge(struct treap_node *l,
+	struct treap_node *r)
+{
+	if (!l)
+		return r;
+	if (!r)
+		return l;
+
+	if (l->prio > r->prio) {
+		l->right = treap_merge(l->right, r);
+		return l;
+	}
+
+	r->left = treap_merge(l, r->left);
+	return r;
+}
+
+/* Ordered-set engine */
+
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - (offsetof(type, member))))
+
+#define treeint_entry(ptr) container_of(ptr, struct treeint, treap_n)
+
+struct treeint {
+	int value;
+	struct treap_node treap_n;
+};
+
+static void *treeint_init(void)
+{
+	struct treap_root *tree = oset_calloc(sizeof(struct treap_root), 1);
+	assert(tree);
+	tree->seed = 2463534242u;
+	return tree;
+}
+
+static struct treap_node *__treeint_insert(struct treap_root *tree,
+	struct treap_node *n, int a, bool *added)
+{
+	if (!n) {
+		struct treeint *i = oset_calloc(sizeof(struct treeint), 1);
+		assert(i);
+		i->value = a;
+		i->treap_n.prio = treap_prio(tree);
+		*added = true;
+		return &i->treap_n;
+	}
+
+	struct treeint *t = treeint_entry(n);
+	if (a < t->value) {
+		n->left = __treeint_insert(tree, n->left, a, added);
+		if (n->left->prio > n->prio)
+			n = treap_rotate_right(n);
+	} else if (a > t->value) {
+		n->right = __treeint_insert(tree, n->right, a, added);
+		if (n->right->prio > n->prio)
+			n = treap_rotate_left(n);
+	}
+
+	return n;
+}
+
+static bool treeint_insert(void *set, int a)
+{
+	struct treap_root *tree = set;
+	bool added = false;
+
+	tree->root = __treeint_insert(tree, tree->root, a, &added);
+	return added;
+}
+
+static bool treeint_find(void *set, int a)
+{
+	struct treap_node *n = ((struct treap_root *) set)->root;
+	while (n) {
+		struct treeint *t = treeint_entry(n);
+		if (a == t->value)
+			return true;
+
+		if (a < t->value)
+			n = n->left;
+		else
+			n = n->right;
+	}
+
+	return false;
+}
+
+static bool treeint_remove(void *set, int a)
+{
+	struct treap_root *tree = set;
+	struct treap_node **link = &tree->root;
+
+	/* the heap order is unaffected above the removed node */
+	while (*link) {
+		struct treeint *t = treeint_entry(*link);
+		if (a == t->value) {
+			*link = treap_merge((*link)->left, (*link)->right);
+			oset_free(t, sizeof(*t));
+			return true;
+		}
+
+		if (a < t->value)
+			link = &(*link)->left;
+		else
+			link = &(*link)->right;
+	}
+
+	return false;
+}
+
+static void __treeint_destroy(struct treap_node *n)
+{
+	if (n->left)
+		__treeint_destroy(n->left);
+
+	if (n->right)
+		__treeint_destroy(n->right);
+
+	oset_free(treeint_entry(n), sizeof(struct treeint));
+}
+
+static void treeint_destroy(void *set)
+{
+	struct treap_root *tree = set;
+
+	assert(tree);
+	if (tree->root)
+		__treeint_destroy(tree->root);
+
+	oset_free(tree, sizeof(*tree));
+}
+
+const struct oset_ops treap_oset_ops = {
+	.name = "treap",
+	.init = treeint_init,
+	.destroy = treeint_destroy,
+	.insert = treeint_insert,
+	.find = treeint_find,
+	.remove = treeint_remove,
+};
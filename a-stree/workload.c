@@ -0,0 +1,185 @@
+#include "workload.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rng.h"
+
+/* keys of the clustered distribution come in runs of this many neighbours */
+#define WL_CLUSTER 64
+
+static const char *dist_names[] = {
+	[WL_UNIFORM] = "uniform",
+	[WL_SEQUENTIAL] = "sequential",
+	[WL_REVERSE] = "reverse",
+	[WL_ZIPF] = "zipf",
+	[WL_CLUSTERED] = "clustered",
+};
+
+/*
+ * YCSB-style mixes translated to a set: an update becomes an insert or a
+ * remove. legacy replays the original stree/rbtest benchmark, which
+ * removes as many random (and thus mostly absent) keys as it inserted.
+ */
+static const struct wl_mix mixes[] = {
+	{"legacy", 0, 0, 100, true},
+	{"ycsb-a", 25, 50, 25, false},  /* update heavy */
+	{"ycsb-b", 3, 95, 2, false},    /* read mostly */
+	{"ycsb-c", 0, 100, 0, false},   /* read only */
+	{"delete", 10, 10, 80, false},  /* delete heavy */
+};
+
+int wl_parse_dist(const char *s, enum wl_dist *d)
+{
+	for (size_t i = 0; i < sizeof(dist_names) / sizeof(dist_names[0]); i++)
+		if (!strcmp(dist_names[i], s)) {
+			*d = i;
+			return 0;
+		}
+	return -1;
+}
+
+const char *wl_dist_name(enum wl_dist d)
+{
+	return dist_names[d];
+}
+
+/* accepts one of the named mixes or insert:find:remove percentages */
+int wl_parse_mix(const char *s, struct wl_mix *m)
+{
+	for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+		if (!strcmp(mixes[i].name, s)) {
+			*m = mixes[i];
+			return 0;
+		}
+
+	unsigned ins, find, rm;
+	char c;
+	/* each at most 100 first, or the sum could wrap around to 100 */
+	if (sscanf(s, "%u:%u:%u%c", &ins, &find, &rm, &c) != 3 ||
+		ins > 100 || find > 100 || rm > 100 || ins + find + rm != 100)
+		return -1;
+
+	*m = (struct wl_mix) {"custom", ins, find, rm, false};
+	return 0;
+}
+
+/* non-negative int, the same range as glibc rand() */
+static inline int rand_key(uint64_t *s)
+{
+	return splitmix64(s) >> 33;
+}
+
+static inline size_t rand_below(uint64_t *s, size_t n)
+{
+	return splitmix64(s) % n;
+}
+
+/* key generator state, shared by the load phase and run-phase inserts */
+struct keygen {
+	enum wl_dist d;
+	uint64_t *s;
+	size_t i;
+	int base;
+};
+
+static int next_key(struct keygen *g, size_t nload)
+{
+	size_t i = g->i++;
+
+	switch (g->d) {
+		case WL_SEQUENTIAL:
+			return i;
+		case WL_REVERSE:
+			/* continues below zero once the loaded range is used up */
+			return (int) nload - 1 - (int) i;
+		case WL_CLUSTERED:
+			/* aligned, so the run cannot overflow past INT_MAX */
+			if (i % WL_CLUSTER == 0)
+				g->base = rand_key(g->s) & ~(WL_CLUSTER - 1);
+			return g->base + i % WL_CLUSTER;
+		case WL_UNIFORM:
+		case WL_ZIPF:
+		default:
+			return rand_key(g->s);
+	}
+}
+
+/* index into the loaded keys for the i-th run-phase find or remove */
+static size_t next_index(enum wl_dist d, size_t i, size_t nload,
+	struct zipf *z, uint64_t *s)
+{
+	switch (d) {
+		case WL_SEQUENTIAL:
+			return i % nload;
+		case WL_REVERSE:
+			return nload - 1 - i % nload;
+		case WL_ZIPF:
+			return zipf_next(z, s);
+		case WL_CLUSTERED: {
+			/* a random neighbour inside one randomly picked run */
+			size_t nrun = (nload + WL_CLUSTER - 1) / WL_CLUSTER;
+			size_t j = rand_below(s, nrun) * WL_CLUSTER +
+				rand_below(s, WL_CLUSTER);
+			return j < nload ? j : rand_below(s, nload);
+		}
+		case WL_UNIFORM:
+		default:
+			return rand_below(s, nload);
+	}
+}
+
+void wl_generate(struct workload *w,
+	size_t nload,
+	size_t nops,
+	enum wl_dist d,
+	const struct wl_mix *m,
+	uint64_t seed)
+{
+	uint64_t s = seed;
+	struct keygen g = {.d = d, .s = &s};
+	struct zipf z = {0};
+
+	assert(m->insert + m->find + m->remove == 100);
+
+	w->nload = nload;
+	w->nops = nops;
+	w->load = calloc(nload ? nload : 1, sizeof(int));
+	w->ops = calloc(nops ? nops : 1, sizeof(struct wl_op));
+	if (!w->load || !w->ops) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < nload; i++)
+		w->load[i] = next_key(&g, nload);
+
+	if (d == WL_ZIPF && nload)
+		zipf_init(&z, nload, ZIPF_THETA);
+
+	for (size_t i = 0; i < nops; i++) {
+		struct wl_op *op = &w->ops[i];
+		unsigned p = rand_below(&s, 100);
+
+		if (p < m->insert)
+			op->type = WL_INSERT;
+		else if (p < m->insert + m->find)
+			op->type = WL_FIND;
+		else
+			op->type = WL_REMOVE;
+
+		if (op->type == WL_INSERT || m->fresh || !nload)
+			op->key = next_key(&g, nload);
+		else
+			op->key = w->load[next_index(d, i, nload, &z, &s)];
+	}
+}
+
+void wl_free(struct workload *w)
+{
+	free(w->load);
+	free(w->ops);
+}
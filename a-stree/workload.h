@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Workload generator for the ordered-set benchmarks.
+ *
+ * A workload has two phases. The load phase inserts nload keys drawn from
+ * the key distribution. The run phase then replays nops operations mixed
+ * according to a wl_mix. Everything is generated up front with a
+ * splitmix64 PRNG so that neither key generation nor libc rand() ends up
+ * inside the measured loops.
+ *
+ * The distribution also decides which loaded key a run-phase find or
+ * remove targets: uniform picks any loaded key, sequential and reverse
+ * walk the loaded keys in (reverse) insertion order, zipf favours a small
+ * set of hot keys, and clustered hits runs of neighbouring keys. Inserts
+ * in the run phase always use fresh keys from the same distribution.
+ */
+
+enum wl_dist {
+	WL_UNIFORM,
+	WL_SEQUENTIAL,
+	WL_REVERSE,
+	WL_ZIPF,
+	WL_CLUSTERED,
+};
+
+enum wl_op_type {
+	WL_INSERT,
+	WL_FIND,
+	WL_REMOVE,
+};
+
+struct wl_op {
+	int key;
+	int type; /* enum wl_op_type */
+};
+
+struct wl_mix {
+	const char *name;
+	/* percentages of the run phase, summing to 100 */
+	unsigned insert, find, remove;
+	/* find/remove use fresh keys, which mostly miss, instead of loaded ones */
+	bool fresh;
+};
+
+struct workload {
+	size_t nload;
+	int *load;
+	size_t nops;
+	struct wl_op *ops;
+};
+
+int wl_parse_dist(const char *s, enum wl_dist *d);
+const char *wl_dist_name(enum wl_dist d);
+int wl_parse_mix(const char *s, struct wl_mix *m);
+
+void wl_generate(struct workload *w,
+	size_t nload,
+	size_t nops,
+	enum wl_dist d,
+	const struct wl_mix *m,
+	uint64_t seed);
+void wl_free(struct workload *w);
@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qsort-mt.h"
+#include "rng.h"
+
+/*
+ * Benchmark of the sorts of qsort-mt.c on a range of input distributions,
+ * sweeping the number of threads and forkelem. Inputs are generated once
+ * per distribution with a splitmix64 PRNG, and every run sorts a fresh copy
+ * of them; neither generation, nor copying, nor verification is timed.
+ * Sorts run on a context created before the runs of each thread count,
+ * so thread creation is not timed either.
+ *
+ * Results are written in the JSON format of hyperfine --export-json, one
+ * result per configuration, whose command is the series name, like
+ * qsort_mt-random-h4-f100, that hf_to_gp.py groups the results by, and
+ * whose parameter n is the x axis. So
+ *
+ *	qsort_bench -n 100000,1000000,10000000 -j results/out.json
+ *
+ * followed by hf_to_gp.py gives a .dat file per series for plot.gp.
+ */
+
+/* distinct values of the fewunique distribution */
+#define FEW_UNIQUE 16
+
+enum dist {
+	D_RANDOM,
+	D_SORTED,
+	D_REVERSE,
+	D_ORGANPIPE,
+	D_FEWUNIQUE,
+	D_EQUAL,
+	D_ZIPF,
+	D_STRING,
+	NDISTS
+};
+
+static const char *dist_names[NDISTS] = {
+	[D_RANDOM] = "random",
+	[D_SORTED] = "sorted",
+	[D_REVERSE] = "reverse",
+	[D_ORGANPIPE] = "organpipe",
+	[D_FEWUNIQUE] = "fewunique",
+	[D_EQUAL] = "equal",
+	[D_ZIPF] = "zipf",
+	[D_STRING] = "string",
+};
+
+enum sorter {
+	S_QSORT_MT,
+	S_LIBC,
+	S_TYPED,    /* qsort_mt_u32() or qsort_mt_str() */
+	S_MERGE,
+	NSORTERS
+};
+
+static const char *sorter_names[NSORTERS] = {
+	[S_QSORT_MT] = "qsort_mt",
+	[S_LIBC] = "libc",
+	[S_TYPED] = "typed",
+	[S_MERGE] = "merge",
+};
+
+/* One configuration, with the times of its runs in seconds. */
+struct result {
+	enum dist dist;
+	enum sorter sorter;
+	int threads;
+	int forkelem;
+	size_t n;
+	int runs;
+	double *times;
+	double user, sys;   /* Means over the runs. */
+};
+
+static int u32_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int string_compare(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+/* Zipf ranks, rank 0 being the most frequent. */
+static void gen_zipf(uint32_t *a, size_t n, uint64_t *s)
+{
+	struct zipf z;
+
+	zipf_init(&z, n, ZIPF_THETA);
+	for (size_t i = 0; i < n; i++)
+		a[i] = zipf_next(&z, s);
+}
+
+/* Generate n integers, or pointers to strings of 20 digits. */
+static void *generate(enum dist d, size_t n, uint64_t seed)
+{
+	uint64_t s = seed;
+	uint32_t *a;
+	char **str;
+
+	if (d == D_STRING) {
+		if ((str = malloc(n * sizeof(*str))) == NULL)
+			err(1, "malloc");
+		for (size_t i = 0; i < n; i++)
+			if (asprintf(&str[i], "%010u%010u",
+				(unsigned) (splitmix64(&s) >> 33),
+				(unsigned) (splitmix64(&s) >> 33)) == -1)
+				err(1, "asprintf");
+		return str;
+	}
+	if ((a = malloc(n * sizeof(*a))) == NULL)
+		err(1, "malloc");
+	switch (d) {
+		case D_RANDOM:
+			for (size_t i = 0; i < n; i++)
+				a[i] = splitmix64(&s);
+			break;
+		case D_SORTED:
+			for (size_t i = 0; i < n; i++)
+				a[i] = i;
+			break;
+		case D_REVERSE:
+			for (size_t i = 0; i < n; i++)
+				a[i] = n - i;
+			break;
+		case D_ORGANPIPE:
+			for (size_t i = 0; i < n; i++)
+				a[i] = i < n / 2 ? i : n - i;
+			break;
+		case D_FEWUNIQUE:
+			for (size_t i = 0; i < n; i++)
+				a[i] = splitmix64(&s) % FEW_UNIQUE;
+			break;
+		case D_EQUAL:
+			for (size_t i = 0; i < n; i++)
+				a[i] = 42;
+			break;
+		case D_ZIPF:
+			gen_zipf(a, n, &s);
+			break;
+		default:
+			abort();
+	}
+	return a;
+}
+
+/* Sort a with the sorter, on ctx unless it is libc qsort(3). */
+static void run_sort(struct qsort_mt_ctx *ctx, enum sorter sorter, bool str,
+	void *a, size_t n, int forkelem)
+{
+	size_t es = str ? sizeof(char *) : sizeof(uint32_t);
+	cmp_t *cmp = str ? string_compare : u32_compare;
+
+	switch (sorter) {
+		case S_QSORT_MT:
+			qsort_mt_ctx_sort(ctx, a, n, es, cmp, forkelem);
+			break;
+		case S_LIBC:
+			qsort(a, n, es, cmp);
+			break;
+		case S_TYPED:
+			if (!str)
+				qsort_mt_u32_ctx(ctx, a, n, forkelem);
+			else if (!qsort_mt_ctx_str(ctx, a, n, forkelem))
+				err(1, "qsort_mt_ctx_str");
+			break;
+		case S_MERGE:
+			if (mergesort_mt_ctx(ctx, a, n, es, cmp, forkelem))
+				err(1, "mergesort_mt_ctx");
+			break;
+		default:
+			abort();
+	}
+}
+
+/* A slice of the sorted elements and of their unsorted copy to check. */
+struct check {
+	pthread_t id;
+	const void *a, *orig;
+	size_t from, to;
+	bool str;
+	bool sorted;
+	uint64_t sum, osum;
+};
+
+/* Check that the slice is in order, including the element after it, and
+ * sum it and its unsorted copy up, which a sort leaves as they were.
+ */
+static void *check_slice(void *p)
+{
+	struct check *c = p;
+
+	c->sorted = true;
+	c->sum = c->osum = 0;
+	for (size_t i = c->from; i < c->to; i++) {
+		if (c->str) {
+			char *const *a = c->a, *const *o = c->orig;
+			if (i > 0 && strcmp(a[i - 1], a[i]) > 0)
+				c->sorted = false;
+			c->sum += (uintptr_t) a[i];
+			c->osum += (uintptr_t) o[i];
+		} else {
+			const uint32_t *a = c->a, *o = c->orig;
+			if (i > 0 && a[i - 1] > a[i])
+				c->sorted = false;
+			c->sum += a[i];
+			c->osum += o[i];
+		}
+	}
+	return NULL;
+}
+
+/* Verify the sort of orig into a on nthreads threads. */
+static bool verify(const void *a, const void *orig, size_t n, bool str,
+	int nthreads)
+{
+	struct check c[nthreads];
+	uint64_t sum = 0, osum = 0;
+	bool sorted = true;
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		c[i].a = a;
+		c[i].orig = orig;
+		c[i].from = n * i / nthreads;
+		c[i].to = n * (i + 1) / nthreads;
+		c[i].str = str;
+		if (i > 0 &&
+			(errno = pthread_create(&c[i].id, NULL, check_slice, &c[i])) != 0)
+			err(1, "pthread_create");
+	}
+	check_slice(&c[0]);
+	for (i = 0; i < nthreads; i++) {
+		if (i > 0)
+			pthread_join(c[i].id, NULL);
+		sorted &= c[i].sorted;
+		sum += c[i].sum;
+		osum += c[i].osum;
+	}
+	return sorted && sum == osum;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tv_sec(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Run one configuration, after warmup runs that are not counted. */
+static void bench(struct result *r, struct qsort_mt_ctx *ctx, const void *orig,
+	void *a, int warmup, bool opt_verify, int vthreads)
+{
+	bool str = r->dist == D_STRING;
+	size_t size = r->n * (str ? sizeof(char *) : sizeof(uint32_t));
+	struct rusage ru0, ru1;
+	double t;
+
+	r->user = r->sys = 0;
+	for (int i = -warmup; i < r->runs; i++) {
+		memcpy(a, orig, size);
+		getrusage(RUSAGE_SELF, &ru0);
+		t = now();
+		run_sort(ctx, r->sorter, str, a, r->n, r->forkelem);
+		t = now() - t;
+		getrusage(RUSAGE_SELF, &ru1);
+		if (opt_verify && !verify(a, orig, r->n, str, vthreads))
+			errx(2, "%s on %s input with %d threads: sort error",
+				sorter_names[r->sorter], dist_names[r->dist], r->threads);
+		if (i < 0)
+			continue;
+		r->times[i] = t;
+		r->user += (tv_sec(ru1.ru_utime) - tv_sec(ru0.ru_utime)) / r->runs;
+		r->sys += (tv_sec(ru1.ru_stime) - tv_sec(ru0.ru_stime)) / r->runs;
+	}
+}
+
+/* What to run on every input, and the results so far. */
+struct sweep {
+	int sorters;            /* Bit mask of enum sorter. */
+	int *threads, nthreads;
+	int *forks, nforks;
+	int runs, warmup;
+	bool verify;
+	bool quiet;             /* No summary lines, the JSON goes to stdout. */
+	int nproc;
+	struct result *res;
+	size_t nres;
+};
+
+/* Run all configurations of sw on n elements of distribution d. */
+static void sweep(struct sweep *sw, enum dist d, size_t n, uint64_t seed)
+{
+	size_t es = d == D_STRING ? sizeof(char *) : sizeof(uint32_t);
+	void *orig = generate(d, n, seed), *a;
+	struct qsort_mt_ctx *ctx;
+	struct result *r;
+	double mean;
+
+	if ((a = malloc(n * es)) == NULL)
+		err(1, "malloc");
+	for (int t = 0; t < sw->nthreads; t++) {
+		if ((ctx = qsort_mt_ctx_create(sw->threads[t])) == NULL)
+			err(1, "qsort_mt_ctx_create");
+		for (int s = 0; s < NSORTERS; s++) {
+			/* libc qsort(3) only needs to run once. */
+			if (!(sw->sorters & 1 << s) || (s == S_LIBC && t > 0))
+				continue;
+			for (int f = 0; f < (s == S_LIBC ? 1 : sw->nforks); f++) {
+				sw->res = realloc(sw->res, (sw->nres + 1) * sizeof(*r));
+				if (sw->res == NULL)
+					err(1, "realloc");
+				r = &sw->res[sw->nres++];
+				r->dist = d;
+				r->sorter = s;
+				r->threads = s == S_LIBC ? 1 : sw->threads[t];
+				r->forkelem = s == S_LIBC ? 0 : sw->forks[f];
+				r->n = n;
+				r->runs = sw->runs;
+				if ((r->times = malloc(r->runs * sizeof(double))) == NULL)
+					err(1, "malloc");
+				bench(r, ctx, orig, a, sw->warmup, sw->verify, sw->nproc);
+				if (sw->quiet)
+					continue;
+				mean = 0;
+				for (int i = 0; i < r->runs; i++)
+					mean += r->times[i] / r->runs;
+				printf("%10zu %-9s %-8s %3d threads %6d fork: %.6f s\n", n,
+					dist_names[d], sorter_names[s], r->threads, r->forkelem,
+					mean);
+			}
+		}
+		qsort_mt_ctx_destroy(ctx);
+	}
+	if (d == D_STRING)
+		for (size_t i = 0; i < n; i++)
+			free(((char **) orig)[i]);
+	free(orig);
+	free(a);
+}
+
+/* Write the results like hyperfine --export-json. */
+static void report_json(const struct result *res, size_t nres, FILE *f)
+{
+	fprintf(f, "{\n  \"results\": [");
+	for (size_t k = 0; k < nres; k++) {
+		const struct result *r = &res[k];
+		double sorted[r->runs], mean = 0, var = 0, median;
+
+		memcpy(sorted, r->times, sizeof(sorted));
+		qsort(sorted, r->runs, sizeof(double), cmp_double);
+		for (int i = 0; i < r->runs; i++)
+			mean += r->times[i] / r->runs;
+		for (int i = 0; i < r->runs; i++)
+			var += (r->times[i] - mean) * (r->times[i] - mean);
+		median = r->runs % 2 ? sorted[r->runs / 2]
+			: (sorted[r->runs / 2 - 1] + sorted[r->runs / 2]) / 2;
+		fprintf(f,
+			"%s\n    {\n"
+			"      \"command\": \"%s-%s-h%d-f%d\",\n"
+			"      \"mean\": %.9f,\n"
+			"      \"stddev\": %.9f,\n"
+			"      \"median\": %.9f,\n"
+			"      \"user\": %.9f,\n"
+			"      \"system\": %.9f,\n"
+			"      \"min\": %.9f,\n"
+			"      \"max\": %.9f,\n"
+			"      \"times\": [",
+			k ? "," : "", sorter_names[r->sorter], dist_names[r->dist],
+			r->threads, r->forkelem, mean,
+			r->runs > 1 ? sqrt(var / (r->runs - 1)) : 0.0, median, r->user,
+			r->sys, sorted[0], sorted[r->runs - 1]);
+		for (int i = 0; i < r->runs; i++)
+			fprintf(f, "%s%.9f", i ? ", " : "", r->times[i]);
+		fprintf(f, "],\n      \"exit_codes\": [");
+		for (int i = 0; i < r->runs; i++)
+			fprintf(f, "%s0", i ? ", " : "");
+		fprintf(f,
+			"],\n"
+			"      \"parameters\": {\"n\": \"%zu\", \"dist\": \"%s\", "
+			"\"sorter\": \"%s\", \"threads\": \"%d\", \"forkelem\": \"%d\"}\n"
+			"    }",
+			r->n, dist_names[r->dist], sorter_names[r->sorter], r->threads,
+			r->forkelem);
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+/* Parse a comma-separated list of names into a bit mask, or -1. */
+static int parse_names(char *list, const char *const *names, int nnames)
+{
+	int mask = 0, i;
+
+	for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+		for (i = 0; i < nnames && strcmp(names[i], s); i++)
+			;
+		if (i == nnames)
+			return -1;
+		mask |= 1 << i;
+	}
+	return mask;
+}
+
+/* Parse a positive decimal number of at most max into *x. */
+static bool parse_number(const char *s, unsigned long long max,
+	unsigned long long *x)
+{
+	char *ep;
+
+	if (*s < '0' || *s > '9')
+		return false;
+	errno = 0;
+	*x = strtoull(s, &ep, 10);
+	return errno == 0 && *ep == '\0' && *x > 0 && *x <= max;
+}
+
+/* Parse a comma-separated list of positive numbers, returning their count. */
+static int parse_numbers(char *list, int **v)
+{
+	unsigned long long x;
+	int n = 0;
+
+	*v = NULL;
+	for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+		if (!parse_number(s, INT_MAX, &x))
+			return -1;
+		if ((*v = realloc(*v, (n + 1) * sizeof(**v))) == NULL)
+			err(1, "realloc");
+		(*v)[n++] = x;
+	}
+	return n > 0 ? n : -1;
+}
+
+/* Like parse_numbers(), for array sizes. */
+static int parse_sizes(char *list, size_t **v)
+{
+	unsigned long long x;
+	int n = 0;
+
+	*v = NULL;
+	for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+		if (!parse_number(s, SIZE_MAX, &x))
+			return -1;
+		if ((*v = realloc(*v, (n + 1) * sizeof(**v))) == NULL)
+			err(1, "realloc");
+		(*v)[n++] = x;
+	}
+	return n > 0 ? n : -1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: qsort_bench [-v] [-d dists] [-e sorters] [-f forkelements]\n"
+		"                   [-h threads] [-j file] [-n elements] [-r runs]\n"
+		"                   [-s seed] [-w warmup]\n"
+		"\t-d\tInput distributions: random, sorted, reverse, organpipe,\n"
+		"\t\tfewunique, equal, zipf, string\n"
+		"\t-e\tSorters: qsort_mt, libc, typed, merge\n"
+		"\t-f\tValues of forkelem to sweep\n"
+		"\t-h\tThread counts to sweep\n"
+		"\t-n\tArray sizes to sweep\n"
+		"\t-j\tWrite the results like hyperfine --export-json to file, - for\n"
+		"\t\tstdout\n"
+		"\t-r\tTimed runs per configuration\n"
+		"\t-v\tVerify every sort, on all processors\n"
+		"\t-w\tUntimed runs per configuration before those\n"
+		"Lists are comma-separated. Defaults are all distributions, qsort_mt\n"
+		"and libc, 1e6 elements, 1, 2, 4, ... threads up to the number of\n"
+		"processors, 100 fork elements, 5 runs after 1 warmup run, seed 1\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sweep sw = {
+		.sorters = 1 << S_QSORT_MT | 1 << S_LIBC,
+		.runs = 5,
+		.warmup = 1,
+		.nproc = sysconf(_SC_NPROCESSORS_ONLN),
+	};
+	int dists = (1 << NDISTS) - 1;
+	size_t *sizes = NULL;
+	int nsizes = 0;
+	uint64_t seed = 1;
+	const char *opt_json = NULL;
+	int ch;
+	char *ep;
+
+	while ((ch = getopt(argc, argv, "d:e:f:h:j:n:r:s:vw:")) != -1) {
+		switch (ch) {
+			case 'd':
+				if ((dists = parse_names(optarg, dist_names, NDISTS)) <= 0) {
+					warnx("unknown distribution -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'e':
+				if ((sw.sorters = parse_names(optarg, sorter_names,
+					NSORTERS)) <= 0) {
+					warnx("unknown sorter -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'f':
+				free(sw.forks);
+				if ((sw.nforks = parse_numbers(optarg, &sw.forks)) < 0) {
+					warnx("illegal list, -f argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'h':
+				free(sw.threads);
+				if ((sw.nthreads = parse_numbers(optarg, &sw.threads)) < 0) {
+					warnx("illegal list, -h argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'j':
+				opt_json = optarg;
+				break;
+			case 'n':
+				free(sizes);
+				if ((nsizes = parse_sizes(optarg, &sizes)) < 0) {
+					warnx("illegal list, -n argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'r':
+				sw.runs = (int) strtol(optarg, &ep, 10);
+				if (sw.runs <= 0 || *ep != '\0') {
+					warnx("illegal number, -r argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 's':
+				seed = strtoull(optarg, &ep, 10);
+				if (*ep != '\0') {
+					warnx("illegal number, -s argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'v':
+				sw.verify = true;
+				break;
+			case 'w':
+				sw.warmup = (int) strtol(optarg, &ep, 10);
+				if (sw.warmup < 0 || *ep != '\0') {
+					warnx("illegal number, -w argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case '?':
+			default:
+				usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+	/* 1, 2, 4, ... threads, and as many as there are processors. */
+	if (sw.nthreads == 0 &&
+		(sw.threads = malloc(CHAR_BIT * sizeof(int) * sizeof(int))) != NULL) {
+		for (int t = 1; t < sw.nproc; t *= 2)
+			sw.threads[sw.nthreads++] = t;
+		sw.threads[sw.nthreads++] = sw.nproc;
+	}
+	if (sw.nforks == 0 && (sw.forks = malloc(sizeof(int))) != NULL)
+		sw.forks[sw.nforks++] = 100;
+	if (nsizes == 0 && (sizes = malloc(sizeof(*sizes))) != NULL)
+		sizes[nsizes++] = 1000000;
+	if (sw.threads == NULL || sw.forks == NULL || sizes == NULL)
+		err(1, "malloc");
+	sw.quiet = opt_json && !strcmp(opt_json, "-");
+
+	for (int k = 0; k < nsizes; k++)
+		for (int d = 0; d < NDISTS; d++)
+			if (dists & 1 << d)
+				sweep(&sw, d, sizes[k], seed);
+
+	if (opt_json && strcmp(opt_json, "-")) {
+		FILE *f = fopen(opt_json, "w");
+		if (!f)
+			err(1, "%s", opt_json);
+		report_json(sw.res, sw.nres, f);
+		fclose(f);
+	} else if (opt_json)
+		report_json(sw.res, sw.nres, stdout);
+
+	for (size_t i = 0; i < sw.nres; i++)
+		free(sw.res[i].times);
+	free(sw.res);
+	free(sw.threads);
+	free(sw.forks);
+	free(sizes);
+	return 0;
+}
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "extsort.h"
+
+/* Smallest merge buffer worth a read(2) of its own. */
+#define MERGE_MINBUF (1 << 20)
+
+static inline size_t min_size(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
+
+/* A sorted run being merged: the records in buf from pos to len, followed
+ * by those in the file from off to end.
+ */
+struct run {
+	char *buf;
+	size_t pos, len;
+	off_t off, end;
+};
+
+/* K-way merge through a tree of losers (Knuth, TAOCP 5.4.1). Inner node i
+ * of the k - 1 holds the run that lost the match there, tree[0] the run
+ * whose record comes next. Exhausted runs lose every match. Each pass
+ * merges groups of up to fanin runs of fd, through buffers of bufsize
+ * bytes, one for the output first.
+ */
+struct merge {
+	int fd;
+	size_t es;
+	cmp_t *cmp;
+	int k, fanin;
+	struct run *runs;
+	int *tree;
+	char *buf;
+	size_t bufsize;
+};
+
+/* Read up to n bytes at off, short only at the end of the file. */
+static ssize_t read_full(int fd, char *buf, size_t n, off_t off)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < n) {
+		if ((r = pread(fd, buf + done, n - done, off + done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static int write_full(int fd, const char *buf, size_t n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write(fd, buf, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* Make sure run r has a record in its buffer, unless it is exhausted.
+ * Returns -1 on a read error.
+ */
+static int run_fill(struct merge *m, struct run *r, size_t bufsize)
+{
+	ssize_t n;
+
+	if (r->pos < r->len || r->off == r->end)
+		return 0;
+	if ((n = read_full(m->fd, r->buf, min_size(bufsize, r->end - r->off),
+			r->off)) < 0)
+		return -1;
+	if (n == 0 || n % m->es) {
+		errno = EIO;
+		return -1;
+	}
+	r->off += n;
+	r->pos = 0;
+	r->len = n;
+	return 0;
+}
+
+static inline bool run_done(const struct run *r)
+{
+	return r->pos == r->len;
+}
+
+/* Whether run a's record goes before run b's. Ties go to the earlier run,
+ * so that the merge is stable.
+ */
+static bool run_less(struct merge *m, int a, int b)
+{
+	struct run *ra = &m->runs[a], *rb = &m->runs[b];
+	int c;
+
+	if (run_done(ra))
+		return false;
+	if (run_done(rb))
+		return true;
+	c = m->cmp(ra->buf + ra->pos, rb->buf + rb->pos);
+	return c < 0 || (c == 0 && a < b);
+}
+
+/* Play the matches below node, returning the winner. Leaves are the nodes
+ * from k on.
+ */
+static int tree_build(struct merge *m, int node)
+{
+	int l, r;
+
+	if (node >= m->k)
+		return node - m->k;
+	l = tree_build(m, 2 * node);
+	r = tree_build(m, 2 * node + 1);
+	if (run_less(m, r, l)) {
+		m->tree[node] = l;
+		return r;
+	}
+	m->tree[node] = r;
+	return l;
+}
+
+/* Replay the matches of run w, whose record changed, up to the root. */
+static void tree_replay(struct merge *m, int w)
+{
+	int node, t;
+
+	for (node = (w + m->k) / 2; node > 0; node /= 2)
+		if (run_less(m, m->tree[node], w)) {
+			t = m->tree[node];
+			m->tree[node] = w;
+			w = t;
+		}
+	m->tree[0] = w;
+}
+
+/* Plan merging the runs of runsize bytes of a file of size bytes with
+ * about mem bytes of buffers: in one pass if that leaves every run a buffer
+ * of MERGE_MINBUF, otherwise in as many passes as needed to. Returns the
+ * number of passes, or -1 with errno set if the buffers cannot be had.
+ */
+static int merge_plan(struct merge *m, size_t size, size_t runsize,
+	size_t mem)
+{
+	size_t nruns = (size + runsize - 1) / runsize, k;
+	size_t fanin = mem / MERGE_MINBUF;
+	int passes = 0;
+
+	/* One of the buffers is the output's. Below three of MERGE_MINBUF,
+	 * the buffers get smaller instead.
+	 */
+	fanin = fanin > 3 ? fanin - 1 : 2;
+	m->fanin = (int) min_size(min_size(fanin, nruns), INT_MAX);
+	m->bufsize = mem / (m->fanin + 1) / m->es * m->es;
+	if (m->bufsize == 0) {
+		errno = EFBIG;
+		return -1;
+	}
+	m->runs = malloc(m->fanin * sizeof(*m->runs));
+	m->tree = malloc(m->fanin * sizeof(*m->tree));
+	m->buf = malloc((m->fanin + 1) * m->bufsize);
+	if (m->runs == NULL || m->tree == NULL || m->buf == NULL)
+		return -1;
+	for (k = nruns; k > 1; k = (k + m->fanin - 1) / m->fanin)
+		passes++;
+	return passes;
+}
+
+/* Merge the sorted runs of runsize bytes among the size bytes at start of
+ * m->fd into out.
+ */
+static int merge_group(struct merge *m, int out, off_t start, size_t size,
+	size_t runsize)
+{
+	size_t bufsize = m->bufsize, olen = 0;
+	char *buf = m->buf;
+	struct run *r;
+	int i;
+
+	m->k = (size + runsize - 1) / runsize;
+	for (i = 0; i < m->k; i++) {
+		r = &m->runs[i];
+		r->buf = buf + (i + 1) * bufsize;
+		r->pos = r->len = 0;
+		r->off = start + i * runsize;
+		r->end = start + min_size(size, (i + 1) * runsize);
+		if (run_fill(m, r, bufsize) < 0)
+			return -1;
+	}
+	m->tree[0] = tree_build(m, 1);
+	for (;;) {
+		r = &m->runs[m->tree[0]];
+		if (run_done(r))
+			break;
+		memcpy(buf + olen, r->buf + r->pos, m->es);
+		r->pos += m->es;
+		if ((olen += m->es) == bufsize) {
+			if (write_full(out, buf, olen) < 0)
+				return -1;
+			olen = 0;
+		}
+		if (run_fill(m, r, bufsize) < 0)
+			return -1;
+		tree_replay(m, m->tree[0]);
+	}
+	return write_full(out, buf, olen);
+}
+
+/* Merge the sorted runs of runsize bytes of the size bytes of m->fd, fanin
+ * at a time, into runs fanin times as long in out.
+ */
+static int merge_pass(struct merge *m, int out, size_t size, size_t runsize)
+{
+	size_t group = runsize > size / m->fanin ? size : runsize * m->fanin;
+
+	if (lseek(out, 0, SEEK_SET) < 0)
+		return -1;
+	posix_fadvise(m->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (size_t off = 0; off < size; off += group)
+		if (merge_group(m, out, off, min_size(group, size - off),
+				runsize) < 0)
+			return -1;
+	return 0;
+}
+
+static size_t gcd(size_t a, size_t b)
+{
+	size_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+int extsort(const char *path,
+	size_t es,
+	cmp_t *cmp,
+	size_t mem,
+	int threads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = NULL;
+	struct merge m = { .es = es, .cmp = cmp };
+	struct stat st;
+	char *map = MAP_FAILED, *tmpname = NULL, *scratchname = NULL;
+	size_t size, unit, runsize, off, n;
+	int fd, out = -1, scratch = -1, passes = 0, pass, ret = -1, saved;
+
+	if (es == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((fd = m.fd = open(path, O_RDWR)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0)
+		goto out;
+	size = st.st_size;
+	if (size % es) {
+		errno = EINVAL;
+		goto out;
+	}
+	if (size == 0) {
+		ret = 0;
+		goto out;
+	}
+	/* Runs start at records and, for mmap(), at pages. */
+	unit = es / gcd(es, sysconf(_SC_PAGESIZE)) * sysconf(_SC_PAGESIZE);
+	runsize = size <= mem ? size : mem / 2 / unit * unit;
+	if (runsize == 0) {
+		errno = ENOMEM;
+		goto out;
+	}
+	/* Whatever the merge needs is had before the file is touched. */
+	if (runsize < size) {
+		if ((passes = merge_plan(&m, size, runsize, mem)) < 0)
+			goto out;
+		if (asprintf(&tmpname, "%s.XXXXXX", path) < 0) {
+			tmpname = NULL;
+			goto out;
+		}
+		if ((out = mkstemp(tmpname)) < 0)
+			goto out;
+		/* Passes before the last go back and forth between the output
+		 * and a file of their own, removed right away.
+		 */
+		if (passes > 1) {
+			if (asprintf(&scratchname, "%s.XXXXXX", path) < 0) {
+				scratchname = NULL;
+				goto fail;
+			}
+			if ((scratch = mkstemp(scratchname)) < 0)
+				goto fail;
+			unlink(scratchname);
+		}
+	}
+	if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			0)) == MAP_FAILED)
+		goto fail;
+	/* Falls back to qsort(3) without a pool. */
+	if (threads > 0 || threads == QSORT_MT_AUTO)
+		ctx = qsort_mt_ctx_create(threads);
+
+	madvise(map, runsize, MADV_WILLNEED);
+	for (off = 0; off < size; off += n) {
+		n = min_size(runsize, size - off);
+		/* Have the next run read while this one is sorted. */
+		if (off + n < size)
+			madvise(map + off + n, min_size(runsize, size - off - n),
+				MADV_WILLNEED);
+		if (ctx)
+			qsort_mt_ctx_sort(ctx, map + off, n / es, es, cmp, forkelem);
+		else
+			qsort(map + off, n / es, es, cmp);
+		/* The sorted run is written back in the background, and no
+		 * longer needs to stay in memory.
+		 */
+		if (runsize < size)
+			madvise(map + off, n, MADV_DONTNEED);
+	}
+	if (runsize == size) {
+		ret = 0;
+		goto out;
+	}
+
+	munmap(map, size);
+	map = MAP_FAILED;
+	/* The last pass writes to out. */
+	for (pass = passes - 1; pass >= 0; pass--) {
+		if (merge_pass(&m, pass % 2 ? scratch : out, size, runsize) < 0)
+			goto fail;
+		m.fd = pass % 2 ? scratch : out;
+		runsize = runsize > size / m.fanin ? size : runsize * m.fanin;
+	}
+	if (fchmod(out, st.st_mode & 07777) < 0 || fsync(out) < 0 ||
+		rename(tmpname, path) < 0)
+		goto fail;
+	ret = 0;
+	goto out;
+fail:
+	if (tmpname && out >= 0) {
+		saved = errno;
+		unlink(tmpname);
+		errno = saved;
+	}
+out:
+	saved = errno;
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	if (out >= 0)
+		close(out);
+	if (scratch >= 0)
+		close(scratch);
+	free(tmpname);
+	free(scratchname);
+	free(m.buf);
+	free(m.tree);
+	free(m.runs);
+	close(fd);
+	errno = saved;
+	return ret;
+}
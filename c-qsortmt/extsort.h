@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "qsort-mt.h"
+
+/* Sort the file at path, an array of records of es bytes, in place by cmp,
+ * using about mem bytes of memory and a qsort_mt pool of threads threads.
+ * Files of up to mem bytes are mapped and sorted as a whole. Larger ones
+ * are sorted as mapped runs of mem / 2 bytes, the next of which is read
+ * ahead while the current one is sorted, and the runs are then merged into
+ * a new file that replaces the old one, in more than one pass if merging
+ * them at once would leave each less than a megabyte of buffer. Returns 0,
+ * or -1 with errno set, leaving the file untouched if the memory or files
+ * the merge needs cannot be had.
+ */
+int extsort(const char *path,
+	size_t es,
+	cmp_t *cmp,
+	size_t mem,
+	int threads,
+	int forkelem);
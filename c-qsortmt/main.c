@@ -0,0 +1,542 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "extsort.h"
+#include "perfev.h"
+#include "qsort-mt.h"
+
+#ifndef ELEM_T
+#define ELEM_T uint32_t
+#endif
+
+/* Not a subtraction, which overflows for unsigned and wide types. */
+int num_compare(const void *a, const void *b)
+{
+	return (*(ELEM_T *) a > *(ELEM_T *) b) - (*(ELEM_T *) a < *(ELEM_T *) b);
+}
+
+QSORT_MT_DEFINE(num_sort_cmp, ELEM_T, QSORT_MT_LESS)
+
+/* The library's own sort for ELEM_T if it has one, which switches to radix
+ * sort for large inputs.
+ */
+#define num_sort(a, n, threads, forkelem)                                  \
+    _Generic((ELEM_T) 0,                                                   \
+        uint32_t: qsort_mt_u32,                                            \
+        uint64_t: qsort_mt_u64,                                            \
+        float: qsort_mt_float,                                             \
+        double: qsort_mt_double,                                           \
+        default: num_sort_cmp)(a, n, threads, forkelem)
+
+#define num_sort_ctx(ctx, a, n, forkelem)                                  \
+    _Generic((ELEM_T) 0,                                                   \
+        uint32_t: qsort_mt_u32_ctx,                                        \
+        uint64_t: qsort_mt_u64_ctx,                                        \
+        float: qsort_mt_float_ctx,                                         \
+        double: qsort_mt_double_ctx,                                       \
+        default: num_sort_cmp_ctx)(ctx, a, n, forkelem)
+
+int string_compare(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+void *xmalloc(size_t s)
+{
+	void *p;
+
+	if ((p = malloc(s)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return (p);
+}
+
+enum sorter {
+	SORT_QSORT_MT,
+	SORT_LIBC,
+	SORT_TYPED,  /* num_sort() on ELEM_T elements instead of cmp */
+	SORT_STRING, /* qsort_mt_str() on strings instead of cmp */
+	SORT_MERGE,  /* stable, mergesort_mt() */
+};
+
+/* Sort nelem elements as rounds consecutive arrays of (about) equal size.
+ * More than one round runs back to back on a single sorting context, the
+ * way a service sorting many mid-sized arrays would use it. That is pool if
+ * it is not NULL, which is also used for a single round.
+ */
+void sort_rounds(void *a, size_t nelem, size_t es, cmp_t *cmp, size_t rounds,
+	enum sorter sorter, struct qsort_mt_ctx *pool, int threads,
+	int forkelements)
+{
+	struct qsort_mt_ctx *ctx = pool;
+	size_t chunk = nelem / rounds;
+
+	if (rounds == 1 && pool == NULL) {
+		switch (sorter) {
+			case SORT_QSORT_MT:
+				qsort_mt(a, nelem, es, cmp, threads, forkelements);
+				break;
+			case SORT_LIBC:
+				qsort(a, nelem, es, cmp);
+				break;
+			case SORT_TYPED:
+				num_sort(a, nelem, threads, forkelements);
+				break;
+			case SORT_STRING:
+				if (!qsort_mt_str(a, nelem, threads, forkelements))
+					err(1, "qsort_mt_str");
+				break;
+			case SORT_MERGE:
+				if (mergesort_mt(a, nelem, es, cmp, threads, forkelements))
+					err(1, "mergesort_mt");
+				break;
+		}
+		return;
+	}
+
+	if (ctx == NULL && sorter != SORT_LIBC &&
+		(ctx = qsort_mt_ctx_create(threads)) == NULL)
+		warn("qsort_mt_ctx_create; sorting on this thread");
+	for (size_t r = 0; r < rounds; r++) {
+		char *p = (char *) a + r * chunk * es;
+		size_t n = r == rounds - 1 ? nelem - r * chunk : chunk;
+
+		switch (sorter) {
+			case SORT_QSORT_MT:
+				if (ctx)
+					qsort_mt_ctx_sort(ctx, p, n, es, cmp, forkelements);
+				else
+					qsort(p, n, es, cmp);
+				break;
+			case SORT_LIBC:
+				qsort(p, n, es, cmp);
+				break;
+			case SORT_TYPED:
+				if (ctx)
+					num_sort_ctx(ctx, (ELEM_T *) p, n, forkelements);
+				else
+					num_sort((ELEM_T *) p, n, 0, forkelements);
+				break;
+			case SORT_STRING:
+				/* Runs on this thread without a context. */
+				if (!qsort_mt_ctx_str(ctx, (char **) p, n, forkelements))
+					err(1, "qsort_mt_ctx_str");
+				break;
+			case SORT_MERGE:
+				/* Runs on this thread without a context. */
+				if (mergesort_mt_ctx(ctx, p, n, es, cmp, forkelements))
+					err(1, "mergesort_mt_ctx");
+				break;
+		}
+	}
+	if (ctx && ctx != pool)
+		qsort_mt_ctx_destroy(ctx);
+}
+
+/* Sort nelem elements as if appended in batches of (about) equal size, each
+ * sorted and merged into those before it as it comes, on pool if it is not
+ * NULL.
+ */
+void sort_batches(void *a, size_t nelem, size_t es, cmp_t *cmp,
+	size_t batches, struct qsort_mt_ctx *pool, int threads, int forkelements)
+{
+	struct qsort_mt_ctx *ctx = pool;
+	size_t chunk = nelem / batches;
+
+	if (ctx == NULL && (ctx = qsort_mt_ctx_create(threads)) == NULL)
+		warn("qsort_mt_ctx_create; sorting on this thread");
+	for (size_t b = 0; b < batches; b++) {
+		size_t n = b == batches - 1 ? nelem : (b + 1) * chunk;
+
+		if (qsort_mt_ctx_append(ctx, a, n, es, n - b * chunk, cmp,
+				forkelements) < 0)
+			err(1, "qsort_mt_ctx_append");
+	}
+	if (ctx && ctx != pool)
+		qsort_mt_ctx_destroy(ctx);
+}
+
+/* Size of the huge pages -H puts the elements on. */
+#define HUGE_PAGE ((size_t) 2 << 20)
+
+/* Allocate s bytes on huge pages, fewer of which cover the elements than
+ * of normal pages and so miss the TLB less: reserved ones if there are
+ * enough, otherwise transparent ones, which the kernel only makes of memory
+ * aligned to them.
+ */
+void *xmalloc_huge(size_t s)
+{
+	size_t len = (s + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+	void *p;
+
+	if ((p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+		return p;
+	if ((errno = posix_memalign(&p, HUGE_PAGE, len)) != 0)
+		err(1, "posix_memalign");
+	if (madvise(p, len, MADV_HUGEPAGE) < 0)
+		warn("madvise MADV_HUGEPAGE");
+	return p;
+}
+
+/* A random number below n, including beyond RAND_MAX. */
+size_t random_below(size_t n)
+{
+	if (n <= RAND_MAX)
+		return rand() % n;
+	return ((size_t) rand() << 31 ^ rand()) % n;
+}
+
+/* Parse a CPU list like 0-3,8,10-11 into *cpus, returning their number. */
+int parse_cpus(const char *list, int **cpus)
+{
+	int n = 0, lo, hi, len;
+
+	*cpus = NULL;
+	for (;;) {
+		if (sscanf(list, "%d%n", &lo, &len) != 1 || lo < 0)
+			return -1;
+		list += len;
+		hi = lo;
+		if (*list == '-') {
+			if (sscanf(list + 1, "%d%n", &hi, &len) != 1 || hi < lo)
+				return -1;
+			list += 1 + len;
+		}
+		*cpus = realloc(*cpus, (n + hi - lo + 1) * sizeof(**cpus));
+		if (*cpus == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		while (lo <= hi)
+			(*cpus)[n++] = lo++;
+		if (*list == '\0')
+			return n;
+		if (*list++ != ',')
+			return -1;
+	}
+}
+
+/* Map the ELEM_T records of a file for reading, setting *nelem. */
+ELEM_T *map_file(const char *path, size_t *nelem)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+		err(1, "%s", path);
+	*nelem = st.st_size / sizeof(ELEM_T);
+	if (*nelem == 0)
+		p = NULL;
+	else if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+		MAP_FAILED)
+		err(1, "mmap %s", path);
+	close(fd);
+	return p;
+}
+
+void usage(void)
+{
+	fprintf(
+		stderr,
+		"usage: qsort_mt [-Hilmpstv] [-f forkelements] [-h threads] [-n elements]\n"
+		"                [-r rounds | -b batches] [-a cpus] [-j file] [-F file [-M megabytes]]\n"
+		"\t-a\tPin the sorting threads to a list of CPUs like 0-3,8, first\n"
+		"\t\ttouching the elements on them, and steal work within NUMA\n"
+		"\t\tnodes first\n"
+		"\t-b\tSort the elements as appended in that many batches, merging\n"
+		"\t\teach into the sorted ones before it\n"
+		"\t-f, -h\tauto derives the fork elements or threads from the size of\n"
+		"\t\tthe input, its elements and the caches, the number of CPUs and a\n"
+		"\t\tcalibration, read from or saved to the file named by\n"
+		"\t\tQSORT_MT_TUNE if that is set\n"
+		"\t-F\tSort the integers of a binary file in place instead, through\n"
+		"\t\tsorted runs and a merge if it is larger than the -M memory\n"
+		"\t\t(default: half of physical memory)\n"
+		"\t-H\tPut the elements on huge pages, reserved ones if there are\n"
+		"\t\tenough, otherwise transparent ones\n"
+		"\t-i\tUse the sort specialized for the elements: for integers radix\n"
+		"\t\tsort for large inputs, or quicksort with inlined comparisons,\n"
+		"\t\tfor strings multikey quicksort on cached prefixes\n"
+		"\t-j\tWrite what each sorting thread did as JSON to file, - for\n"
+		"\t\tstdout\n"
+		"\t-l\tRun the libc version of qsort\n"
+		"\t-m\tRun the stable parallel merge sort instead\n"
+		"\t-p\tPrint hardware performance counters for generation and sort\n"
+		"\t-r\tSort the elements as that many separate arrays in a row\n"
+		"\t-s\tTest with 20-byte strings, instead of integers\n"
+		"\t-t\tPrint timing results\n"
+		"\t-v\tVerify the integer results\n"
+		"Defaults are 1e7 elements, 2 threads, 100 fork elements\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	bool opt_str = false;
+	bool opt_time = false;
+	bool opt_verify = false;
+	bool opt_perf = false;
+	bool opt_huge = false;
+	enum sorter sorter = SORT_QSORT_MT;
+	int nsorters = 0;
+	const char *opt_file = NULL;
+	const char *opt_json = NULL;
+	int *cpus = NULL;
+	int ncpus = 0;
+	struct qsort_mt_ctx *pool = NULL;
+	size_t mem = (size_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+	int ch;
+	size_t i;
+	size_t nelem = 10000000;
+	size_t rounds = 1;
+	size_t batches = 1;
+	int threads = 2;
+	int forkelements = 100;
+	ELEM_T *int_elem = NULL;
+	char *ep;
+	long mb;
+	char **str_elem = NULL;
+	struct timeval start, end;
+	struct rusage ru0, ru;
+	struct perfev pev;
+	struct perfev_sample pev_gen, pev_sort;
+
+	while ((ch = getopt(argc, argv, "a:b:F:f:Hh:ij:lM:mn:pr:stv")) != -1) {
+		switch (ch) {
+			case 'a':
+				free(cpus);
+				if ((ncpus = parse_cpus(optarg, &cpus)) < 0) {
+					warnx("illegal CPU list, -a argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'b':
+				batches = (size_t) strtol(optarg, &ep, 10);
+				if (batches == 0 || *ep != '\0') {
+					warnx("illegal number, -b argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'F':
+				opt_file = optarg;
+				break;
+			case 'f':
+				if (strcmp(optarg, "auto") == 0) {
+					forkelements = QSORT_MT_AUTO;
+					break;
+				}
+				forkelements = (int) strtol(optarg, &ep, 10);
+				if (forkelements <= 0 || *ep != '\0') {
+					warnx("illegal number, -f argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'h':
+				if (strcmp(optarg, "auto") == 0) {
+					threads = QSORT_MT_AUTO;
+					break;
+				}
+				threads = (int) strtol(optarg, &ep, 10);
+				if (threads < 0 || *ep != '\0') {
+					warnx("illegal number, -h argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'H':
+				opt_huge = true;
+				break;
+			case 'i':
+				sorter = SORT_TYPED;
+				nsorters++;
+				break;
+			case 'j':
+				opt_json = optarg;
+				break;
+			case 'l':
+				sorter = SORT_LIBC;
+				nsorters++;
+				break;
+			case 'M':
+				mb = strtol(optarg, &ep, 10);
+				if (mb <= 0 || (size_t) mb > SIZE_MAX >> 20 || *ep != '\0') {
+					warnx("illegal number, -M argument -- %s", optarg);
+					usage();
+				}
+				mem = (size_t) mb << 20;
+				break;
+			case 'm':
+				sorter = SORT_MERGE;
+				nsorters++;
+				break;
+			case 'n':
+				nelem = (size_t) strtol(optarg, &ep, 10);
+				if (nelem == 0 || *ep != '\0') {
+					warnx("illegal number, -n argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 'p':
+				opt_perf = true;
+				break;
+			case 'r':
+				rounds = (size_t) strtol(optarg, &ep, 10);
+				if (rounds == 0 || *ep != '\0') {
+					warnx("illegal number, -r argument -- %s", optarg);
+					usage();
+				}
+				break;
+			case 's':
+				opt_str = true;
+				break;
+			case 't':
+				opt_time = true;
+				break;
+			case 'v':
+				opt_verify = true;
+				break;
+			case '?':
+			default:
+				usage();
+		}
+	}
+
+	if (opt_verify && opt_str)
+		usage();
+	if (nsorters > 1)
+		usage();
+	if (sorter == SORT_TYPED && opt_str)
+		sorter = SORT_STRING;
+	if (rounds > nelem || batches > nelem)
+		usage();
+	if (batches > 1 && (rounds > 1 || nsorters > 0))
+		usage();
+	if (opt_file &&
+		(opt_str || rounds > 1 || batches > 1 || nsorters > 0 || cpus ||
+			opt_json || opt_huge))
+		usage();
+	if ((cpus || opt_json) && (sorter == SORT_LIBC || threads == 0))
+		usage();
+
+	argc -= optind;
+	argv += optind;
+
+	/* opened before qsort_mt() creates its threads, so they inherit them */
+	if (opt_perf) {
+		if (perfev_open(&pev) == 0)
+			warnx("no performance counters available");
+		perfev_start(&pev);
+	}
+	/* The statistics are those of a pool of our own. */
+	if ((cpus || opt_json) &&
+		(pool = qsort_mt_ctx_create_pinned(threads, cpus, ncpus)) == NULL)
+		err(1, "qsort_mt_ctx_create_pinned");
+
+	if (opt_str) {
+		str_elem = opt_huge ? xmalloc_huge(nelem * sizeof(char *))
+				   : xmalloc(nelem * sizeof(char *));
+		if (pool)
+			qsort_mt_ctx_touch(pool, str_elem, nelem * sizeof(char *));
+		for (i = 0; i < nelem; i++)
+			if (asprintf(&str_elem[i], "%d%d", rand(), rand()) == -1) {
+				perror("asprintf");
+				exit(1);
+			}
+	} else if (opt_file == NULL) {
+		int_elem = opt_huge ? xmalloc_huge(nelem * sizeof(ELEM_T))
+				   : xmalloc(nelem * sizeof(ELEM_T));
+		if (pool)
+			qsort_mt_ctx_touch(pool, int_elem, nelem * sizeof(ELEM_T));
+		for (i = 0; i < nelem; i++)
+			int_elem[i] = random_below(nelem);
+	}
+	if (opt_perf) {
+		perfev_stop(&pev, &pev_gen);
+		perfev_start(&pev);
+	}
+	if (pool)
+		qsort_mt_ctx_stats_reset(pool);
+	/* Time the sort only, not generating its input. */
+	getrusage(RUSAGE_SELF, &ru0);
+	gettimeofday(&start, NULL);
+	if (opt_file) {
+		if (extsort(opt_file, sizeof(ELEM_T), num_compare, mem, threads,
+				forkelements) < 0)
+			err(1, "%s", opt_file);
+	} else if (batches > 1)
+		sort_batches(opt_str ? (void *) str_elem : (void *) int_elem, nelem,
+			opt_str ? sizeof(char *) : sizeof(ELEM_T),
+			opt_str ? string_compare : num_compare, batches, pool, threads,
+			forkelements);
+	else if (opt_str)
+		sort_rounds(str_elem, nelem, sizeof(char *), string_compare, rounds,
+			sorter, pool, threads, forkelements);
+	else
+		sort_rounds(int_elem, nelem, sizeof(ELEM_T), num_compare, rounds,
+			sorter, pool, threads, forkelements);
+	if (opt_perf)
+		perfev_stop(&pev, &pev_sort);
+	gettimeofday(&end, NULL);
+	if (opt_json) {
+		int n = qsort_mt_ctx_stats(pool, NULL, 0);
+		struct qsort_mt_stats *st = xmalloc(n * sizeof(*st));
+		FILE *f = stdout;
+
+		qsort_mt_ctx_stats(pool, st, n);
+		if (strcmp(opt_json, "-") && (f = fopen(opt_json, "w")) == NULL)
+			err(1, "%s", opt_json);
+		qsort_mt_stats_json(st, n, f);
+		if (f != stdout)
+			fclose(f);
+		free(st);
+	}
+	getrusage(RUSAGE_SELF, &ru);
+	if (opt_verify && opt_file)
+		int_elem = map_file(opt_file, &nelem);
+	if (opt_verify) {
+		for (i = 1; i < nelem; i++) {
+			/* Rounds are sorted independently of each other. */
+			if (i % (nelem / rounds) == 0 && i / (nelem / rounds) < rounds)
+				continue;
+			if (int_elem[i - 1] > int_elem[i]) {
+				fprintf(stderr,
+					"sort error at position %zu: "
+					" %ju > %ju\n",
+					i, (uintmax_t) int_elem[i - 1], (uintmax_t) int_elem[i]);
+				exit(2);
+			}
+		}
+	}
+	if (opt_time)
+		printf(
+			"%.3g %.3g %.3g\n",
+			(end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6,
+			(ru.ru_utime.tv_sec - ru0.ru_utime.tv_sec) +
+				(ru.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e6,
+			(ru.ru_stime.tv_sec - ru0.ru_stime.tv_sec) +
+				(ru.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6);
+	if (opt_perf) {
+		/* per-op figures are per element */
+		perfev_print("generate", &pev_gen, nelem, stdout);
+		perfev_print("sort", &pev_sort, nelem, stdout);
+		perfev_close(&pev);
+	}
+	if (pool)
+		qsort_mt_ctx_destroy(pool);
+	free(cpus);
+	return (0);
+}
\ No newline at end of file
@@ -1,11 +1,23 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qsort-mt.h"
 
 #define verify(x)                                                      \
     do {                                                               \
@@ -17,21 +29,39 @@
         }                                                              \
     } while (0)
 
-typedef int cmp_t(const void *, const void *);
 static inline char *med3(char *, char *, char *, cmp_t *, void *);
-static inline void swapfunc(char *, char *, int, int);
+static inline void swapfunc(char *, char *, size_t, int);
 
 #define min(a, b)           \
-    ({                      \
+    __extension__ ({        \
         typeof(a) _a = (a); \
         typeof(b) _b = (b); \
         _a < _b ? _a : _b;  \
     })
 
+#define max(a, b)           \
+    __extension__ ({        \
+        typeof(a) _a = (a); \
+        typeof(b) _b = (b); \
+        _a > _b ? _a : _b;  \
+    })
+
+/* With QSORT_MT_STATS, the generic sorts count their comparisons and swaps
+ * per thread; pool threads add them to their statistics after every task.
+ */
+#ifdef QSORT_MT_STATS
+static _Thread_local struct {
+	uint64_t cmps, swaps;
+} tcount;
+#define COUNT(field, k) (tcount.field += (k))
+#else
+#define COUNT(field, k) ((void) 0)
+#endif
+
 /* Qsort routine from Bentley & McIlroy's "Engineering a Sort Function" */
 #define swapcode(TYPE, parmi, parmj, n) \
     {                                   \
-        long i = (n) / sizeof(TYPE);    \
+        size_t i = (n) / sizeof(TYPE);  \
         TYPE *pi = (TYPE *) (parmi);    \
         TYPE *pj = (TYPE *) (parmj);    \
         do {                            \
@@ -41,7 +71,7 @@ static inline void swapfunc(char *, char *, int, int);
         } while (--i > 0);              \
     }
 
-static inline void swapfunc(char *a, char *b, int n, int swaptype)
+static inline void swapfunc(char *a, char *b, size_t n, int swaptype)
 {
 	if (swaptype <= 1)
 	swapcode(long, a, b, n) else swapcode(char, a, b, n)
@@ -49,6 +79,7 @@ static inline void swapfunc(char *a, char *b, int n, int swaptype)
 
 #define swap(a, b)                         \
     do {                                   \
+        COUNT(swaps, 1);                   \
         if (swaptype == 0) {               \
             long t = *(long *) (a);        \
             *(long *) (a) = *(long *) (b); \
@@ -57,13 +88,23 @@ static inline void swapfunc(char *a, char *b, int n, int swaptype)
             swapfunc(a, b, es, swaptype);  \
     } while (0)
 
+/* How swap() moves elements of es bytes at a */
+static inline int swap_type(void *a, size_t es)
+{
+	return ((char *) a - (char *) 0) % sizeof(long) || es % sizeof(long)
+		? 2
+		: es == sizeof(long) ? 0
+			: 1;
+}
+
 #define vecswap(a, b, n)                 \
     do {                                 \
+        COUNT(swaps, (n) / es);          \
         if ((n) > 0)                     \
             swapfunc(a, b, n, swaptype); \
     } while (0)
 
-#define CMP(t, x, y) (cmp((x), (y)))
+#define CMP(t, x, y) (COUNT(cmps, 1), cmp((x), (y)))
 
 static inline char *med3(char *a, char *b, char *c, cmp_t *cmp, void *thunk)
 {
@@ -72,458 +113,2693 @@ static inline char *med3(char *a, char *b, char *c, cmp_t *cmp, void *thunk)
 		: (CMP(thunk, b, c) > 0 ? b : (CMP(thunk, a, c) < 0 ? a : c));
 }
 
-/* We use some elaborate condition variables and signalling
- * to ensure a bound of the number of active threads at
- * 2 * maxthreads and the size of the thread data structure
- * to maxthreads.
+/* Work is distributed through one Chase-Lev work-stealing deque per pool
+ * thread (Chase & Lev, "Dynamic Circular Work-Stealing Deque", with the
+ * C11 memory orderings of Le et al., "Correct and Efficient Work-Stealing
+ * for Weak Memory Models"). A thread pushes the left part of every
+ * partition larger than forkelem onto the bottom of its own deque and
+ * carries on with the right part; idle threads steal from the top of the
+ * deques of others. Only a full deque makes a thread sort a large part
+ * inline, so no work is serialized merely because nobody was idle at the
+ * moment of the fork.
  */
 
-/* Condition of starting a new thread. */
-enum thread_state {
-	ts_idle, /* Idle, waiting for instructions. */
-	ts_work, /* Has work to do. */
-	ts_term  /* Asked to terminate. */
+#define CACHE_LINE 64
+
+/* Slots per deque, a power of two. */
+#define DEQUE_SIZE 1024
+
+/* A subproblem of n elements at a. */
+struct task {
+	void *a;
+	size_t n;
+	struct common *c;           /* Sort it belongs to. */
+	int bad;                    /* Bad partitions it may still take. */
+	bool pred;                  /* Preceded by an element not greater. */
+};
+
+struct deque {
+	_Alignas(CACHE_LINE) atomic_long top;    /* Next slot to steal. */
+	_Alignas(CACHE_LINE) atomic_long bottom; /* Next slot to push. */
+	/* Slots are atomic so that a thief racing with the owner reads a
+	 * stale but well-defined value, which its CAS on top then rejects.
+	 */
+	_Alignas(CACHE_LINE) struct {
+		_Atomic(void *) a;
+		atomic_size_t n;
+		_Atomic(struct common *) c;
+		atomic_int bad;
+		atomic_bool pred;
+	} buf[DEQUE_SIZE];
+};
+
+/* Partitions of at least ppart_min elements are not split by their owner
+ * alone. The owner picks the pivot and opens its ppart slot; idle threads
+ * join through it. In a first phase, participants claim blocks of the
+ * partition and partition each block in place around the shared pivot. The
+ * owner then sums up the blocks: the elements not less than the pivot which
+ * lie below the final split point, and those less than the pivot which lie
+ * above it, form two equally long lists of segments, one per block. In the
+ * second phase participants claim ranges of these lists and swap them
+ * pairwise, after which the partition is complete. This is the scheme of
+ * parallel block partitioning (Frias & Petit; Axtmann et al., IPS4o) with
+ * the fix-up of misplaced elements done in parallel too.
+ */
+
+/* Minimum number of elements per block. */
+#define PPART_BLOCK 2048
+/* Maximum number of blocks per pool thread. */
+#define PPART_SPLIT 16
+/* Minimum number of elements partitioned cooperatively. */
+#define PPART_MIN (1 << 17)
+
+struct ppart {
+	_Alignas(CACHE_LINE) atomic_bool open; /* Helpers may join. */
+	atomic_int active;          /* Helpers inside, or trying to get in. */
+	atomic_int phase;           /* 1: partition blocks, 2: fix up. */
+	_Alignas(CACHE_LINE) atomic_size_t next_block;
+	atomic_size_t blocks_done;
+	atomic_size_t next_chunk;
+	atomic_size_t chunks_done;
+	/* Set before open, read only while it is. */
+	_Alignas(CACHE_LINE) struct common *c;
+	char *pivot;                /* Element to partition around. */
+	char *base;                 /* Start of the m elements to partition. */
+	size_t m;
+	size_t bs;                  /* Elements per block. */
+	size_t nblocks;
+	/* Set before phase 2. */
+	size_t lt;                  /* Elements less than the pivot. */
+	size_t nchunks;             /* Pieces of bs misplaced elements. */
+	/* Per block: elements less than the pivot, and prefix sums of the
+	 * misplaced elements below and above the split point.
+	 */
+	size_t *nlt, *lpre, *rpre;
 };
 
-/* Variant part passed to qsort invocations. */
+/* Per-thread part of the pool. */
 struct qsort {
-	enum thread_state st;   /* For coordinating work. */
-	struct common *common;  /* Common shared elements. */
-	void *a;                /* Array base. */
-	size_t n;               /* Number of elements. */
-	pthread_t id;           /* Thread id. */
-	pthread_mutex_t mtx_st; /* For signalling state change. */
-	pthread_cond_t cond_st; /* For signalling state change. */
+	struct deque dq;            /* Work owned by this thread. */
+	struct ppart pp;            /* Partition this thread leads. */
+	struct qsort_mt_ctx *ctx;   /* Pool this thread belongs to. */
+	struct common *c;           /* Sort of the task being run. */
+	unsigned int seed;          /* For picking victims to steal from. */
+	int node;                   /* NUMA node if pinned, or -1. */
+	int depth;                  /* Of qsort_algo() recursion. */
+	struct qsort_mt_stats st;   /* Written by this thread only. */
+	pthread_t id;               /* Thread id. */
 };
 
-/* Invariant common part, shared across invocations. */
+/* Invariant common part of one sort, shared by all its tasks. Any number
+ * of sorts may be in progress on a pool; tasks carry the sort they belong
+ * to along.
+ */
 struct common {
 	int swaptype;           /* Code to use for swapping */
 	size_t es;              /* Element size. */
 	void *thunk;            /* Thunk for qsort_r */
 	cmp_t *cmp;             /* Comparison function */
-	int nthreads;           /* Total number of pool threads. */
-	int idlethreads;        /* Number of idle threads in pool. */
-	int forkelem;           /* Minimum number of elements for a new thread. */
-	struct qsort *pool;     /* Fixed pool of threads. */
-	pthread_mutex_t mtx_al; /* For allocating threads in the pool. */
+	qsort_mt_task_t *task;  /* Sorts one part. */
+	qsort_mt_part_t *part;  /* Partitions one block for ppart(). */
+	int forkelem;           /* Minimum number of elements for a new task. */
+	size_t ppart_min;       /* Minimum number of elements for ppart(). */
+	atomic_size_t pending;  /* Tasks pushed or running, not yet done. */
+	atomic_uint done;       /* Futex word, see ctx_wait(). */
+	struct task root;       /* First task, queued until a thread takes it. */
+	struct common *next;    /* Next sort in the queue of roots. */
+};
+
+/* The pool, alive from qsort_mt_ctx_create() to qsort_mt_ctx_destroy(). */
+struct qsort_mt_ctx {
+	int nthreads;             /* Total number of pool threads. */
+	struct qsort *pool;       /* Fixed pool of threads. */
+	size_t *ppmeta;           /* Block counts for all ppart slots. */
+	bool spin;                /* Idle threads spin before parking. */
+	bool numa;                /* Threads are pinned to several nodes. */
+	double since;             /* Statistics are counted from here. */
+	atomic_int nsleeping;     /* Threads parked, or about to park. */
+	atomic_bool has_root;     /* Mirrors roots != NULL for lockless peeks. */
+	atomic_bool term;         /* Threads are asked to exit. */
+	/* Futex word, bumped whenever parked threads should look. */
+	_Alignas(CACHE_LINE) atomic_uint work_seq;
+	pthread_mutex_t mtx;      /* Protects the fields below. */
+	struct common *roots;     /* Sorts whose first task nobody took yet. */
+	struct common **roots_tail;
 };
 
+/* Idle threads look for work this many times before they park, unless
+ * there are more of them than processors.
+ */
+#define PARK_SPIN 1000
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void futex_wait(atomic_uint *addr, unsigned int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Monotonic time in seconds. */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Add the counts of the calling thread to its statistics. */
+static void stats_flush(struct qsort *qs)
+{
+#ifdef QSORT_MT_STATS
+	qs->st.cmps += tcount.cmps;
+	qs->st.swaps += tcount.swaps;
+	tcount.cmps = tcount.swaps = 0;
+#else
+	(void) qs;
+#endif
+}
+
+/* Make parked threads look for work again. */
+static void wake_threads(struct qsort_mt_ctx *ctx, bool all)
+{
+	atomic_fetch_add(&ctx->work_seq, 1);
+	futex_wake(&ctx->work_seq, all ? INT_MAX : 1);
+}
+
+/* Called by the owner only. Returns false if the deque is full. */
+static bool deque_push(struct deque *q, const struct task *task)
+{
+	long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&q->top, memory_order_acquire);
+
+	if (b - t >= DEQUE_SIZE)
+		return false;
+	atomic_store_explicit(&q->buf[b & (DEQUE_SIZE - 1)].a, task->a,
+		memory_order_relaxed);
+	atomic_store_explicit(&q->buf[b & (DEQUE_SIZE - 1)].n, task->n,
+		memory_order_relaxed);
+	atomic_store_explicit(&q->buf[b & (DEQUE_SIZE - 1)].c, task->c,
+		memory_order_relaxed);
+	atomic_store_explicit(&q->buf[b & (DEQUE_SIZE - 1)].bad, task->bad,
+		memory_order_relaxed);
+	atomic_store_explicit(&q->buf[b & (DEQUE_SIZE - 1)].pred, task->pred,
+		memory_order_relaxed);
+	/* Publishes the slot to thieves, who load bottom with acquire. */
+	atomic_store_explicit(&q->bottom, b + 1, memory_order_release);
+	return true;
+}
+
+/* Called by the owner only, takes the most recently pushed task. */
+static bool deque_pop(struct deque *q, struct task *task)
+{
+	long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+	long t;
+	bool found = true;
+
+	atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&q->top, memory_order_relaxed);
+	if (t > b) {
+		/* Empty. */
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+		return false;
+	}
+	task->a = atomic_load_explicit(&q->buf[b & (DEQUE_SIZE - 1)].a,
+		memory_order_relaxed);
+	task->n = atomic_load_explicit(&q->buf[b & (DEQUE_SIZE - 1)].n,
+		memory_order_relaxed);
+	task->c = atomic_load_explicit(&q->buf[b & (DEQUE_SIZE - 1)].c,
+		memory_order_relaxed);
+	task->bad = atomic_load_explicit(&q->buf[b & (DEQUE_SIZE - 1)].bad,
+		memory_order_relaxed);
+	task->pred = atomic_load_explicit(&q->buf[b & (DEQUE_SIZE - 1)].pred,
+		memory_order_relaxed);
+	if (t == b) {
+		/* Last task, race against thieves for it. */
+		found = atomic_compare_exchange_strong_explicit(&q->top, &t,
+			t + 1, memory_order_seq_cst, memory_order_relaxed);
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+	}
+	return found;
+}
+
+/* Called by any thread, takes the oldest task. */
+static bool deque_steal(struct deque *q, struct task *task)
+{
+	for (;;) {
+		long t = atomic_load_explicit(&q->top, memory_order_acquire);
+		atomic_thread_fence(memory_order_seq_cst);
+		long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+
+		if (t >= b)
+			return false;
+		task->a = atomic_load_explicit(&q->buf[t & (DEQUE_SIZE - 1)].a,
+			memory_order_relaxed);
+		task->n = atomic_load_explicit(&q->buf[t & (DEQUE_SIZE - 1)].n,
+			memory_order_relaxed);
+		task->c = atomic_load_explicit(&q->buf[t & (DEQUE_SIZE - 1)].c,
+			memory_order_relaxed);
+		task->bad = atomic_load_explicit(&q->buf[t & (DEQUE_SIZE - 1)].bad,
+			memory_order_relaxed);
+		task->pred = atomic_load_explicit(&q->buf[t & (DEQUE_SIZE - 1)].pred,
+			memory_order_relaxed);
+		if (atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+			return true;
+		/* Lost against the owner or another thief; look again. */
+	}
+}
+
+static bool deque_empty(struct deque *q)
+{
+	return atomic_load_explicit(&q->top, memory_order_acquire) >=
+		atomic_load_explicit(&q->bottom, memory_order_acquire);
+}
+
 static void *qsort_thread(void *p);
+static void qsort_task(struct qsort *qs, void *a, size_t n, int bad,
+	bool pred);
+static size_t qsort_part(void *a, size_t n, const void *pivot, void *arg);
 
-/* The multithreaded qsort public interface */
-void qsort_mt(void *a,
-	size_t n,
-	size_t es,
-	cmp_t *cmp,
-	int maxthreads,
-	int forkelem)
+/* The NUMA node of a CPU, 0 if sysfs does not tell. */
+static int cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *de;
+	DIR *d;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((d = opendir(path)) == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL)
+		if (sscanf(de->d_name, "node%d", &node) == 1)
+			break;
+	closedir(d);
+	return node;
+}
+
+/* Create pool thread qs, pinned to cpu unless that is -1. */
+static int start_thread(struct qsort *qs, int cpu)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int e;
+
+	if (cpu < 0)
+		return pthread_create(&qs->id, NULL, qsort_thread, qs);
+	if ((e = pthread_attr_init(&attr)) != 0)
+		return e;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if ((e = pthread_attr_setaffinity_np(&attr, sizeof(set), &set)) == 0)
+		e = pthread_create(&qs->id, &attr, qsort_thread, qs);
+	verify(pthread_attr_destroy(&attr));
+	return e;
+}
+
+struct qsort_mt_ctx *qsort_mt_ctx_create(int nthreads)
+{
+	return qsort_mt_ctx_create_pinned(nthreads, NULL, 0);
+}
+
+struct qsort_mt_ctx *qsort_mt_ctx_create_pinned(int nthreads,
+	const int *cpus,
+	int ncpus)
 {
+	struct qsort_mt_ctx *ctx;
 	struct qsort *qs;
-	struct common c;
-	int i, islot;
-	bool bailout = true;
+	size_t split;
+	int i, islot, e;
 
-	if (n < forkelem)
-		goto f1;
-	errno = 0;
+	if (nthreads == QSORT_MT_AUTO)
+		nthreads = cpus ? ncpus : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1 || (cpus && ncpus < 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for (i = 0; cpus && i < ncpus; i++)
+		if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+			errno = EINVAL;
+			return NULL;
+		}
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
 	/* Try to initialize the resources we need. */
-	if (pthread_mutex_init(&c.mtx_al, NULL) != 0)
+	if ((e = pthread_mutex_init(&ctx->mtx, NULL)) != 0)
 		goto f1;
-	if ((c.pool = calloc(maxthreads, sizeof(struct qsort))) == NULL)
+	if ((e = posix_memalign((void **) &ctx->pool, CACHE_LINE,
+		nthreads * sizeof(struct qsort))) != 0)
 		goto f2;
-	for (islot = 0; islot < maxthreads; islot++) {
-		qs = &c.pool[islot];
-		if (pthread_mutex_init(&qs->mtx_st, NULL) != 0)
-			goto f3;
-		if (pthread_cond_init(&qs->cond_st, NULL) != 0) {
-			verify(pthread_mutex_destroy(&qs->mtx_st));
-			goto f3;
-		}
-		qs->st = ts_idle;
-		qs->common = &c;
-		if (pthread_create(&qs->id, NULL, qsort_thread, qs) != 0) {
-			verify(pthread_mutex_destroy(&qs->mtx_st));
-			verify(pthread_cond_destroy(&qs->cond_st));
-			goto f3;
-		}
+	split = (size_t) PPART_SPLIT * nthreads;
+	if ((ctx->ppmeta = calloc(nthreads * (3 * split + 2),
+		sizeof(size_t))) == NULL) {
+		e = ENOMEM;
+		goto f3;
 	}
 
-	/* All systems go. */
-	bailout = false;
+	ctx->nthreads = nthreads;
+	ctx->spin = nthreads <= sysconf(_SC_NPROCESSORS_ONLN);
+	atomic_init(&ctx->nsleeping, 0);
+	atomic_init(&ctx->has_root, false);
+	atomic_init(&ctx->term, false);
+	atomic_init(&ctx->work_seq, 0);
+	ctx->roots = NULL;
+	ctx->roots_tail = &ctx->roots;
+	ctx->since = now();
+	for (i = 0; i < nthreads; i++) {
+		qs = &ctx->pool[i];
+		atomic_init(&qs->dq.top, 0);
+		atomic_init(&qs->dq.bottom, 0);
+		qs->ctx = ctx;
+		qs->seed = i + 1;
+		qs->depth = 0;
+		memset(&qs->st, 0, sizeof(qs->st));
+		atomic_init(&qs->pp.open, false);
+		atomic_init(&qs->pp.active, 0);
+		qs->pp.nlt = ctx->ppmeta + i * (3 * split + 2);
+		qs->pp.lpre = qs->pp.nlt + split;
+		qs->pp.rpre = qs->pp.lpre + split + 1;
+		qs->node = cpus ? cpu_node(cpus[i % ncpus]) : -1;
+		if (qs->node != ctx->pool[0].node)
+			ctx->numa = true;
+	}
 
-	/* Initialize common elements. */
-	c.swaptype = ((char *) a - (char *) 0) % sizeof(long) || es % sizeof(long)
-		? 2
-		: es == sizeof(long) ? 0
-			: 1;
-	c.es = es;
-	c.cmp = cmp;
-	c.forkelem = forkelem;
-	c.idlethreads = c.nthreads = maxthreads;
-
-	/* Hand out the first work batch. */
-	qs = &c.pool[0];
-	verify(pthread_mutex_lock(&qs->mtx_st));
-	qs->a = a;
-	qs->n = n;
-	qs->st = ts_work;
-	c.idlethreads--;
-	verify(pthread_cond_signal(&qs->cond_st));
-	verify(pthread_mutex_unlock(&qs->mtx_st));
-
-	/* Wait for all threads to finish, and free acquired resources. */
-	f3:
-	for (i = 0; i < islot; i++) {
-		qs = &c.pool[i];
-		if (bailout) {
-			verify(pthread_mutex_lock(&qs->mtx_st));
-			qs->st = ts_term;
-			// change to broadcast?
-			verify(pthread_cond_signal(&qs->cond_st));
-			verify(pthread_mutex_unlock(&qs->mtx_st));
-		}
-		verify(pthread_join(qs->id, NULL));
-		verify(pthread_mutex_destroy(&qs->mtx_st));
-		verify(pthread_cond_destroy(&qs->cond_st));
+	for (islot = 0; islot < nthreads; islot++) {
+		qs = &ctx->pool[islot];
+		if ((e = start_thread(qs, cpus ? cpus[islot % ncpus] : -1)) != 0)
+			goto f4;
 	}
-	free(c.pool);
+	return ctx;
+
+	f4:
+	/* Tear down the threads we managed to create. */
+	ctx->nthreads = islot;
+	qsort_mt_ctx_destroy(ctx);
+	errno = e;
+	return NULL;
+	f3:
+	free(ctx->pool);
 	f2:
-	verify(pthread_mutex_destroy(&c.mtx_al));
-	if (bailout) {
-		fprintf(stderr, "Resource initialization failed; bailing out.\n");
-		f1:
-		qsort(a, n, es, cmp);
-	}
+	verify(pthread_mutex_destroy(&ctx->mtx));
+	f1:
+	free(ctx);
+	errno = e;
+	return NULL;
 }
 
-#define thunk NULL
+void qsort_mt_ctx_destroy(struct qsort_mt_ctx *ctx)
+{
+	atomic_store(&ctx->term, true);
+	wake_threads(ctx, true);
 
-/* Allocate an idle thread from the pool, lock its mutex, change its state to
- * work, decrease the number of idle threads, and return a pointer to its data
- * area.
- * Return NULL, if no thread is available.
- */
-static struct qsort *allocate_thread(struct common *c)
-{
-	verify(pthread_mutex_lock(&c->mtx_al));
-	for (int i = 0; i < c->nthreads; i++)
-		if (c->pool[i].st == ts_idle) {
-			c->idlethreads--;
-			verify(pthread_mutex_lock(&c->pool[i].mtx_st));
-			c->pool[i].st = ts_work;
-			verify(pthread_mutex_unlock(&c->mtx_al));
-			return (&c->pool[i]);
-		}
-	verify(pthread_mutex_unlock(&c->mtx_al));
-	return (NULL);
+	for (int i = 0; i < ctx->nthreads; i++)
+		verify(pthread_join(ctx->pool[i].id, NULL));
+	free(ctx->ppmeta);
+	free(ctx->pool);
+	verify(pthread_mutex_destroy(&ctx->mtx));
+	free(ctx);
 }
 
-/* Thread-callable quicksort. */
-static void qsort_algo(struct qsort *qs)
+int qsort_mt_ctx_stats(struct qsort_mt_ctx *ctx,
+	struct qsort_mt_stats *st,
+	int nst)
 {
-	char *pa, *pb, *pc, *pd, *pl, *pm, *pn;
-	int d, r, swaptype, swap_cnt;
-	void *a;      /* Array of elements. */
-	size_t n, es; /* Number of elements; size. */
-	cmp_t *cmp;
-	int nl, nr;
-	struct common *c;
-	struct qsort *qs2;
-
-	/* Initialize qsort arguments. */
-	c = qs->common;
-	es = c->es;
-	cmp = c->cmp;
-	swaptype = c->swaptype;
-	a = qs->a;
-	n = qs->n;
-	top:
-	/* From here on qsort(3) business as usual. */
-	swap_cnt = 0;
-	if (n < 7) {
-		for (pm = (char *) a + es; pm < (char *) a + n * es; pm += es)
-			for (pl = pm; pl > (char *) a && CMP(thunk, pl - es, pl) > 0;
-				pl -= es)
-				swap(pl, pl - es);
-		return;
+	double t = now();
+
+	for (int i = 0; i < ctx->nthreads && i < nst; i++) {
+		st[i] = ctx->pool[i].st;
+		st[i].idle = t - ctx->since - st[i].busy;
 	}
-	pm = (char *) a + (n / 2) * es;
-	if (n > 7) {
-		pl = (char *) a;
-		pn = (char *) a + (n - 1) * es;
-		if (n > 40) {
-			d = (n / 8) * es;
-			pl = med3(pl, pl + d, pl + 2 * d, cmp, thunk);
-			pm = med3(pm - d, pm, pm + d, cmp, thunk);
-			pn = med3(pn - 2 * d, pn - d, pn, cmp, thunk);
-		}
-		pm = med3(pl, pm, pn, cmp, thunk);
+	return ctx->nthreads;
+}
+
+void qsort_mt_ctx_stats_reset(struct qsort_mt_ctx *ctx)
+{
+	for (int i = 0; i < ctx->nthreads; i++)
+		memset(&ctx->pool[i].st, 0, sizeof(ctx->pool[i].st));
+	ctx->since = now();
+}
+
+static void stats_json(const struct qsort_mt_stats *s, FILE *f)
+{
+	fprintf(f,
+		"{\"tasks\": %" PRIu64 ", \"steals\": %" PRIu64
+		", \"forks\": %" PRIu64 ", \"inlined\": %" PRIu64
+		", \"partitions\": %" PRIu64 ", \"helped\": %" PRIu64
+		", \"max_depth\": %d, \"busy\": %.6f, \"idle\": %.6f",
+		s->tasks, s->steals, s->forks, s->inlined, s->partitions,
+		s->helped, s->max_depth, s->busy, s->idle);
+#ifdef QSORT_MT_STATS
+	fprintf(f, ", \"cmps\": %" PRIu64 ", \"swaps\": %" PRIu64 "}",
+		s->cmps, s->swaps);
+#else
+	fprintf(f, ", \"cmps\": null, \"swaps\": null}");
+#endif
+}
+
+void qsort_mt_stats_json(const struct qsort_mt_stats *st, int n, FILE *f)
+{
+	struct qsort_mt_stats sum;
+	double maxbusy = 0;
+
+	memset(&sum, 0, sizeof(sum));
+	fprintf(f, "{\n  \"threads\": [");
+	for (int i = 0; i < n; i++) {
+		fprintf(f, "%s\n    ", i ? "," : "");
+		stats_json(&st[i], f);
+		sum.tasks += st[i].tasks;
+		sum.steals += st[i].steals;
+		sum.forks += st[i].forks;
+		sum.inlined += st[i].inlined;
+		sum.partitions += st[i].partitions;
+		sum.helped += st[i].helped;
+		sum.cmps += st[i].cmps;
+		sum.swaps += st[i].swaps;
+		sum.max_depth = max(sum.max_depth, st[i].max_depth);
+		sum.busy += st[i].busy;
+		sum.idle += st[i].idle;
+		maxbusy = max(maxbusy, st[i].busy);
 	}
-	swap(a, pm);
-	pa = pb = (char *) a + es;
+	fprintf(f, "\n  ],\n  \"total\": ");
+	stats_json(&sum, f);
+	fprintf(f, ",\n  \"imbalance\": %.3f\n}\n",
+		sum.busy > 0 ? maxbusy * n / sum.busy : 1.0);
+}
+
+/* Start sorting n elements at a on the pool. The caller fills in the
+ * element size, comparison, task and block partition functions of c, which
+ * must stay put until ctx_wait() returns.
+ */
+static void ctx_submit(struct qsort_mt_ctx *ctx,
+	struct common *c,
+	void *a,
+	size_t n,
+	int forkelem)
+{
+	/* Initialize common elements. */
+	c->swaptype = swap_type(a, c->es);
+	c->forkelem = forkelem;
+	/* Only as long as there are fewer parts than threads. */
+	c->ppart_min = ctx->nthreads > 1 ? n / ctx->nthreads : SIZE_MAX;
+	if (c->ppart_min < PPART_MIN)
+		c->ppart_min = PPART_MIN;
+	if (c->ppart_min < (size_t) forkelem)
+		c->ppart_min = forkelem;
+	atomic_init(&c->pending, 1);
+	atomic_init(&c->done, 0);
+	c->root.a = a;
+	c->root.n = n;
+	c->root.c = c;
+	c->root.bad = qsort_mt_log2(n);
+	c->root.pred = false;
+	c->next = NULL;
+
+	/* Queue the first task for whichever thread comes first. */
+	verify(pthread_mutex_lock(&ctx->mtx));
+	*ctx->roots_tail = c;
+	ctx->roots_tail = &c->next;
+	atomic_store_explicit(&ctx->has_root, true, memory_order_relaxed);
+	verify(pthread_mutex_unlock(&ctx->mtx));
+	/* As in fork_task(). */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ctx->nsleeping, memory_order_relaxed) > 0)
+		wake_threads(ctx, false);
+}
+
+/* Wait for the last task of c to finish: done goes from 0 to 1 when it
+ * does, and to 2 first if we sleep, which asks for a wakeup.
+ */
+static void ctx_wait(struct common *c)
+{
+	unsigned int d;
 
-	pc = pd = (char *) a + (n - 1) * es;
 	for (;;) {
-		while (pb <= pc && (r = CMP(thunk, pb, a)) <= 0) {
-			if (r == 0) {
-				swap_cnt = 1;
-				swap(pa, pb);
-				pa += es;
-			}
-			pb += es;
-		}
-		while (pb <= pc && (r = CMP(thunk, pc, a)) >= 0) {
-			if (r == 0) {
-				swap_cnt = 1;
-				swap(pc, pd);
-				pd -= es;
-			}
-			pc -= es;
-		}
-		if (pb > pc)
+		d = atomic_load_explicit(&c->done, memory_order_acquire);
+		if (d == 1)
 			break;
-		swap(pb, pc);
-		swap_cnt = 1;
-		pb += es;
-		pc -= es;
+		if (d == 0 && !atomic_compare_exchange_strong(&c->done, &d, 2))
+			continue;
+		futex_wait(&c->done, 2);
 	}
+}
 
-	pn = (char *) a + n * es;
-	r = min(pa - (char *) a, pb - pa);
-	vecswap(a, pb - r, r);
-	r = min(pd - pc, pn - pd - es);
-	vecswap(pb, pn - r, r);
+static void ctx_run(struct qsort_mt_ctx *ctx,
+	struct common *c,
+	void *a,
+	size_t n,
+	int forkelem)
+{
+	ctx_submit(ctx, c, a, n, forkelem);
+	ctx_wait(c);
+}
 
-	if (swap_cnt == 0) { /* Switch to insertion sort */
-		r = 1 + n / 4;   /* n >= 7, so r >= 2 */
-		for (pm = (char *) a + es; pm < (char *) a + n * es; pm += es)
-			for (pl = pm; pl > (char *) a && CMP(thunk, pl - es, pl) > 0;
-				pl -= es) {
-				swap(pl, pl - es);
-				if (++swap_cnt > r)
-					goto nevermind;
-			}
-		return;
-	}
+/*
+ * Automatic tuning, for a forkelem or maxthreads of QSORT_MT_AUTO. A part
+ * is worth handing off to another thread when sorting it takes several
+ * times as long as the handoff. Both are measured once: the handoff as the
+ * round trip of an empty sort through a pool, sorting as the time a
+ * comparison sort takes per element and level of recursion.
+ */
+
+/* Sorting a part handed off takes this many times as long as the handoff. */
+#define TUNE_RATIO 8
+/* Parts per thread worth starting a thread for. */
+#define TUNE_PARTS 8
+/* Elements sorted, and empty sorts run, for measuring. */
+#define TUNE_ELEMS (1 << 14)
+#define TUNE_ROUNDS 200
+
+static struct {
+	pthread_once_t once;
+	bool valid;
+	double handoff_ns;
+	double elem_ns;
+} tune = { .once = PTHREAD_ONCE_INIT };
+
+static void tune_noop(struct qsort *qs, void *a, size_t n, int bad,
+	bool pred)
+{
+	(void) qs;
+	(void) a;
+	(void) n;
+	(void) bad;
+	(void) pred;
+}
+
+static int tune_cmp(const void *a, const void *b)
+{
+	return (*(const int *) a > *(const int *) b) -
+		(*(const int *) a < *(const int *) b);
+}
 
-	nevermind:
-	nl = (pb - pa) / es;
-	nr = (pd - pc) / es;
+static int tune_measure(void)
+{
+	struct qsort_mt_ctx *ctx;
+	struct common c;
+	unsigned int seed = 1;
+	double t, best = 0;
+	int *a, r;
 
-	/* Now try to launch subthreads. */
-	if (nl > c->forkelem && nr > c->forkelem &&
-		(qs2 = allocate_thread(c)) != NULL) {
-		qs2->a = a;
-		qs2->n = nl;
-		verify(pthread_cond_signal(&qs2->cond_st));
-		verify(pthread_mutex_unlock(&qs2->mtx_st));
-	} else if (nl > 0) {
-		qs->a = a;
-		qs->n = nl;
-		qsort_algo(qs);
+	if ((a = malloc(TUNE_ELEMS * sizeof(*a))) == NULL)
+		return -1;
+	for (r = 0; r < 3; r++) {
+		for (size_t i = 0; i < TUNE_ELEMS; i++)
+			a[i] = rand_r(&seed);
+		t = now();
+		qsort(a, TUNE_ELEMS, sizeof(*a), tune_cmp);
+		t = now() - t;
+		if (r == 0 || t < best)
+			best = t;
 	}
-	if (nr > 0) {
-		a = pn - nr * es;
-		n = nr;
-		goto top;
+	free(a);
+
+	if ((ctx = qsort_mt_ctx_create(2)) == NULL)
+		return -1;
+	c.es = 1;
+	c.cmp = NULL;
+	c.task = tune_noop;
+	c.part = NULL;
+	t = now();
+	for (r = -TUNE_ROUNDS / 10; r < TUNE_ROUNDS; r++) {
+		if (r == 0)
+			t = now();
+		ctx_run(ctx, &c, &c, 1, 1);
 	}
+	tune.handoff_ns = (now() - t) * 1e9 / TUNE_ROUNDS;
+	tune.elem_ns = best * 1e9 / TUNE_ELEMS / qsort_mt_log2(TUNE_ELEMS);
+	qsort_mt_ctx_destroy(ctx);
+	return 0;
 }
 
-/* Thread-callable quicksort. */
-static void *qsort_thread(void *p)
+int qsort_mt_calibrate(const char *path)
 {
-	struct qsort *qs, *qs2;
-	int i;
-	struct common *c;
+	double handoff_ns, elem_ns;
+	FILE *f;
 
-	qs = p;
-	c = qs->common;
-	again:
-	/* Wait for work to be allocated. */
-	verify(pthread_mutex_lock(&qs->mtx_st));
-	// st will be set to ts_work / ts_term before pthread_cond_signal()
-	while (qs->st == ts_idle)
-		verify(pthread_cond_wait(&qs->cond_st, &qs->mtx_st));
-	verify(pthread_mutex_unlock(&qs->mtx_st));
-	if (qs->st == ts_term) {
-		return NULL;
+	if (path && (f = fopen(path, "r")) != NULL) {
+		if (fscanf(f, "handoff_ns %lf elem_ns %lf", &handoff_ns,
+			&elem_ns) == 2 && handoff_ns > 0 && elem_ns > 0) {
+			tune.handoff_ns = handoff_ns;
+			tune.elem_ns = elem_ns;
+			tune.valid = true;
+		}
+		fclose(f);
+		if (tune.valid)
+			return 0;
 	}
-	assert(qs->st == ts_work);
+	if (tune_measure() < 0)
+		return -1;
+	tune.valid = true;
+	if (path == NULL)
+		return 0;
+	if ((f = fopen(path, "w")) == NULL)
+		return -1;
+	fprintf(f, "handoff_ns %.1f\nelem_ns %.3f\n", tune.handoff_ns,
+		tune.elem_ns);
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+static void tune_init(void)
+{
+	/* Measured but not saved is as good. */
+	if (!tune.valid)
+		(void) qsort_mt_calibrate(getenv("QSORT_MT_TUNE"));
+	if (tune.valid)
+		return;
+	/* Nothing could be measured, guess a slow machine. */
+	tune.handoff_ns = 20000;
+	tune.elem_ns = 10;
+	tune.valid = true;
+}
 
-	qsort_algo(qs);
+/* Number of elements of es bytes a part needs to be worth a handoff. */
+static size_t tune_grain(size_t es)
+{
+	long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	size_t cap = l2 > 0 ? (size_t) l2 : (size_t) 1 << 18;
+	size_t m = 2;
+	double elem;
 
-	verify(pthread_mutex_lock(&c->mtx_al));
-	qs->st = ts_idle;
-	c->idlethreads++;
-	if (c->idlethreads == c->nthreads) {
-		for (i = 0; i < c->nthreads; i++) {
-			qs2 = &c->pool[i];
-			if (qs2 == qs)
-				continue;
-			verify(pthread_mutex_lock(&qs2->mtx_st));
-			qs2->st = ts_term;
-			// wake idle threads
-			verify(pthread_cond_signal(&qs2->cond_st));
-			verify(pthread_mutex_unlock(&qs2->mtx_st));
-		}
-		verify(pthread_mutex_unlock(&c->mtx_al));
+	verify(pthread_once(&tune.once, tune_init));
+	/* Larger elements take longer to move. */
+	elem = tune.elem_ns * (1 + (double) es / CACHE_LINE);
+	while (m * qsort_mt_log2(m) * elem < TUNE_RATIO * tune.handoff_ns)
+		m += m / 4 + 1;
+	/* Smaller parts share cache lines with their neighbors. Parts larger
+	 * than the L2 cache are always worth it, whatever was measured, down to
+	 * a single element larger than the cache.
+	 */
+	m = max(m, 2 * CACHE_LINE / es);
+	return max(min(m, cap / es), (size_t) 1);
+}
+
+static int tune_forkelem(int forkelem, size_t es)
+{
+	if (forkelem != QSORT_MT_AUTO)
+		return forkelem;
+	return (int) min(tune_grain(es), (size_t) INT_MAX);
+}
+
+/* Threads worth a pool of their own for sorting n elements: one for every
+ * TUNE_PARTS parts of the grain, up to the number of processors, or none
+ * if that is one.
+ */
+static int tune_threads(int maxthreads, size_t n, size_t es)
+{
+	size_t t;
+
+	if (maxthreads != QSORT_MT_AUTO)
+		return maxthreads;
+	t = min(n / tune_grain(es) / TUNE_PARTS,
+		(size_t) sysconf(_SC_NPROCESSORS_ONLN));
+	return t < 2 ? 0 : (int) t;
+}
+
+/* A pool of up to maxthreads threads of its own for a sort of n elements
+ * of es bytes, resolving QSORT_MT_AUTO in maxthreads and *forkelem. NULL,
+ * with errno set if creating the pool failed, has the sort run on the
+ * calling thread instead.
+ */
+static struct qsort_mt_ctx *sort_pool(size_t n,
+	size_t es,
+	int maxthreads,
+	int *forkelem)
+{
+	*forkelem = tune_forkelem(*forkelem, es);
+	maxthreads = tune_threads(maxthreads, n, es);
+	if (n < (size_t) *forkelem || maxthreads < 1)
 		return NULL;
+	return qsort_mt_ctx_create(maxthreads);
+}
+
+void qsort_mt_ctx_sort(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int forkelem)
+{
+	struct common c;
+
+	forkelem = tune_forkelem(forkelem, es);
+	if (n < (size_t) forkelem || n < 2) {
+		qsort(a, n, es, cmp);
+		return;
 	}
-	verify(pthread_mutex_unlock(&c->mtx_al));
-	goto again;
+	c.es = es;
+	c.cmp = cmp;
+	c.task = qsort_task;
+	c.part = qsort_part;
+	ctx_run(ctx, &c, a, n, forkelem);
 }
 
-#include <err.h>
-#include <stdint.h>
-#include <sys/resource.h>
-#include <sys/time.h>
-#include <unistd.h>
+struct qsort_mt_job {
+	struct common c;
+};
 
-#ifndef ELEM_T
-#define ELEM_T uint32_t
-#endif
+struct qsort_mt_job *qsort_mt_submit(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int forkelem)
+{
+	struct qsort_mt_job *job;
 
-int num_compare(const void *a, const void *b)
-{
-	return (*(ELEM_T *) a - *(ELEM_T *) b);
-}
-
-int string_compare(const void *a, const void *b)
-{
-	return strcmp(*(char **) a, *(char **) b);
-}
-
-void *xmalloc(size_t s)
-{
-	void *p;
-
-	if ((p = malloc(s)) == NULL) {
-		perror("malloc");
-		exit(1);
-	}
-	return (p);
-}
-
-void usage(void)
-{
-	fprintf(
-		stderr,
-		"usage: qsort_mt [-stv] [-f forkelements] [-h threads] [-n elements]\n"
-		"\t-l\tRun the libc version of qsort\n"
-		"\t-s\tTest with 20-byte strings, instead of integers\n"
-		"\t-t\tPrint timing results\n"
-		"\t-v\tVerify the integer results\n"
-		"Defaults are 1e7 elements, 2 threads, 100 fork elements\n");
-	exit(1);
-}
-
-int main(int argc, char *argv[])
-{
-	bool opt_str = false;
-	bool opt_time = false;
-	bool opt_verify = false;
-	bool opt_libc = false;
-	int ch, i;
-	size_t nelem = 10000000;
-	int threads = 2;
-	int forkelements = 100;
-	ELEM_T *int_elem;
-	char *ep;
-	char **str_elem;
-	struct timeval start, end;
-	struct rusage ru;
-
-	gettimeofday(&start, NULL);
-	while ((ch = getopt(argc, argv, "f:h:ln:stv")) != -1) {
-		switch (ch) {
-			case 'f':
-				forkelements = (int) strtol(optarg, &ep, 10);
-				if (forkelements <= 0 || *ep != '\0') {
-					warnx("illegal number, -f argument -- %s", optarg);
-					usage();
-				}
-				break;
-			case 'h':
-				threads = (int) strtol(optarg, &ep, 10);
-				if (threads < 0 || *ep != '\0') {
-					warnx("illegal number, -h argument -- %s", optarg);
-					usage();
-				}
-				break;
-			case 'l':
-				opt_libc = true;
-				break;
-			case 'n':
-				nelem = (size_t) strtol(optarg, &ep, 10);
-				if (nelem == 0 || *ep != '\0') {
-					warnx("illegal number, -n argument -- %s", optarg);
-					usage();
-				}
-				break;
-			case 's':
-				opt_str = true;
-				break;
-			case 't':
-				opt_time = true;
-				break;
-			case 'v':
-				opt_verify = true;
-				break;
-			case '?':
-			default:
-				usage();
-		}
+	forkelem = tune_forkelem(forkelem, es);
+	if ((job = malloc(sizeof(*job))) == NULL)
+		return NULL;
+	if (n < (size_t) forkelem || n < 2) {
+		qsort(a, n, es, cmp);
+		atomic_init(&job->c.done, 1);
+		return job;
 	}
+	job->c.es = es;
+	job->c.cmp = cmp;
+	job->c.task = qsort_task;
+	job->c.part = qsort_part;
+	ctx_submit(ctx, &job->c, a, n, forkelem);
+	return job;
+}
 
-	if (opt_verify && opt_str)
-		usage();
+bool qsort_mt_poll(struct qsort_mt_job *job)
+{
+	return atomic_load_explicit(&job->c.done, memory_order_acquire) == 1;
+}
 
-	argc -= optind;
-	argv += optind;
+void qsort_mt_wait(struct qsort_mt_job *job)
+{
+	ctx_wait(&job->c);
+	free(job);
+}
 
-	if (opt_str) {
-		str_elem = xmalloc(nelem * sizeof(char *));
-		for (i = 0; i < nelem; i++)
-			if (asprintf(&str_elem[i], "%d%d", rand(), rand()) == -1) {
-				perror("asprintf");
-				exit(1);
-			}
-	} else {
-		int_elem = xmalloc(nelem * sizeof(ELEM_T));
-		for (i = 0; i < nelem; i++)
-			int_elem[i] = rand() % nelem;
-	}
-	if (opt_str) {
-		if (opt_libc)
-			qsort(str_elem, nelem, sizeof(char *), string_compare);
-		else
-			qsort_mt(str_elem, nelem, sizeof(char *), string_compare, threads,
-				forkelements);
-	} else {
-		if (opt_libc)
-			qsort(int_elem, nelem, sizeof(ELEM_T), num_compare);
-		else
-			qsort_mt(int_elem, nelem, sizeof(ELEM_T), num_compare, threads,
-				forkelements);
-	}
-	gettimeofday(&end, NULL);
-	getrusage(RUSAGE_SELF, &ru);
-	if (opt_verify) {
-		for (i = 1; i < nelem; i++)
-			if (int_elem[i - 1] > int_elem[i]) {
-				fprintf(stderr,
-					"sort error at position %d: "
-					" %d > %d\n",
-					i, int_elem[i - 1], int_elem[i]);
-				exit(2);
-			}
-	}
-	if (opt_time)
-		printf(
-			"%.3g %.3g %.3g\n",
-			(end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6,
-			ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
-			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
-	return (0);
-}
\ No newline at end of file
+void qsort_mt_ctx_run(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_task_t *task,
+	qsort_mt_part_t *part,
+	int forkelem)
+{
+	struct common c;
+
+	forkelem = tune_forkelem(forkelem, es);
+	if (n < (size_t) forkelem || n < 2) {
+		task(NULL, a, n, qsort_mt_log2(n), false);
+		return;
+	}
+	c.es = es;
+	c.cmp = NULL;
+	c.task = task;
+	c.part = part;
+	ctx_run(ctx, &c, a, n, forkelem);
+}
+
+/* The multithreaded qsort public interface */
+void qsort_mt(void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, es, maxthreads, &forkelem);
+
+	if (ctx == NULL) {
+		qsort(a, n, es, cmp);
+		return;
+	}
+	qsort_mt_ctx_sort(ctx, a, n, es, cmp, forkelem);
+	qsort_mt_ctx_destroy(ctx);
+}
+
+void qsort_mt_run(void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_task_t *task,
+	qsort_mt_part_t *part,
+	int maxthreads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, es, maxthreads, &forkelem);
+
+	if (ctx == NULL) {
+		task(NULL, a, n, qsort_mt_log2(n), false);
+		return;
+	}
+	qsort_mt_ctx_run(ctx, a, n, es, task, part, forkelem);
+	qsort_mt_ctx_destroy(ctx);
+}
+
+#define thunk NULL
+
+/* Offer n elements at a to other threads, with what is left of the bad
+ * partitions of the part they came from. Return false, if the deque of the
+ * calling thread is full and the caller has to sort them itself.
+ */
+static bool fork_task(struct qsort *qs,
+	struct common *c,
+	void *a,
+	size_t n,
+	int bad,
+	bool pred)
+{
+	struct qsort_mt_ctx *ctx = qs->ctx;
+	struct task task = { a, n, c, bad, pred };
+
+	/* Count the task before anyone can steal and finish it. */
+	atomic_fetch_add_explicit(&c->pending, 1, memory_order_relaxed);
+	if (!deque_push(&qs->dq, &task)) {
+		atomic_fetch_sub_explicit(&c->pending, 1, memory_order_relaxed);
+		qs->st.inlined++;
+		return false;
+	}
+	qs->st.forks++;
+
+	/* Pairs with the fence in qsort_thread() before it parks: either we
+	 * see it sleeping, or it sees our task.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ctx->nsleeping, memory_order_relaxed) > 0)
+		wake_threads(ctx, false);
+	return true;
+}
+
+bool qsort_mt_fork(struct qsort *qs, void *a, size_t n, int bad, bool pred)
+{
+	struct common *c;
+
+	if (qs == NULL)
+		return false;
+	c = qs->c;
+	return n > (size_t) c->forkelem && fork_task(qs, c, a, n, bad, pred);
+}
+
+/* Take the first task of the oldest sort nobody started yet. */
+static bool take_root(struct qsort_mt_ctx *ctx, struct task *task)
+{
+	bool found = false;
+	struct common *c;
+
+	if (!atomic_load_explicit(&ctx->has_root, memory_order_relaxed))
+		return false;
+	verify(pthread_mutex_lock(&ctx->mtx));
+	if ((c = ctx->roots) != NULL) {
+		*task = c->root;
+		if ((ctx->roots = c->next) == NULL) {
+			ctx->roots_tail = &ctx->roots;
+			atomic_store_explicit(&ctx->has_root, false,
+				memory_order_relaxed);
+		}
+		found = true;
+	}
+	verify(pthread_mutex_unlock(&ctx->mtx));
+	return found;
+}
+
+/* Take work from our own deque or, failing that, steal some, starting at a
+ * random victim.
+ */
+static bool find_task(struct qsort *qs, struct task *task)
+{
+	struct qsort_mt_ctx *ctx = qs->ctx;
+	int start, i, pass;
+
+	if (deque_pop(&qs->dq, task))
+		return true;
+	start = rand_r(&qs->seed) % ctx->nthreads;
+	/* Steal on the own NUMA node first, whose parts are more likely to
+	 * be in nearby memory and caches.
+	 */
+	for (pass = ctx->numa ? 0 : 1; pass < 2; pass++)
+		for (i = 0; i < ctx->nthreads; i++) {
+			struct qsort *victim = &ctx->pool[(start + i) % ctx->nthreads];
+			if (victim == qs || (pass == 0 && victim->node != qs->node))
+				continue;
+			if (deque_steal(&victim->dq, task)) {
+				qs->st.steals++;
+				return true;
+			}
+		}
+	return take_root(ctx, task);
+}
+
+static bool any_task(struct qsort_mt_ctx *ctx)
+{
+	if (atomic_load_explicit(&ctx->has_root, memory_order_relaxed))
+		return true;
+	for (int i = 0; i < ctx->nthreads; i++)
+		if (!deque_empty(&ctx->pool[i].dq) ||
+			atomic_load_explicit(&ctx->pool[i].pp.open, memory_order_relaxed))
+			return true;
+	return false;
+}
+
+/* Block partition function of qsort_mt() for ppart(), arg is the common
+ * part of the sort.
+ */
+static size_t qsort_part(void *a, size_t n, const void *pivot, void *arg)
+{
+	struct common *c = arg;
+	size_t es = c->es;
+	int swaptype = c->swaptype;
+	cmp_t *cmp = c->cmp;
+	char *i = a, *j = (char *) a + (n - 1) * es;
+
+	for (;;) {
+		while (i <= j && CMP(thunk, i, pivot) < 0)
+			i += es;
+		while (i < j && CMP(thunk, j, pivot) >= 0)
+			j -= es;
+		if (i >= j)
+			break;
+		swap(i, j);
+		i += es;
+		j -= es;
+	}
+	return (i - (char *) a) / es;
+}
+
+/* Phase 1 of ppart(): partition blocks until none are left. */
+static bool ppart_blocks(struct ppart *pp)
+{
+	struct common *c = pp->c;
+	size_t k, n;
+	bool claimed = false;
+
+	while ((k = atomic_fetch_add_explicit(&pp->next_block, 1,
+		memory_order_relaxed)) < pp->nblocks) {
+		n = k == pp->nblocks - 1 ? pp->m - k * pp->bs : pp->bs;
+		pp->nlt[k] = c->part(pp->base + k * pp->bs * c->es, n, pp->pivot, c);
+		atomic_fetch_add_explicit(&pp->blocks_done, 1, memory_order_release);
+		claimed = true;
+	}
+	return claimed;
+}
+
+/* Between the phases of ppart(): find the split point and the misplaced
+ * elements on either side of it.
+ */
+static void ppart_plan(struct ppart *pp)
+{
+	size_t k, s, e, p, lt = 0;
+
+	for (k = 0; k < pp->nblocks; k++)
+		lt += pp->nlt[k];
+	pp->lpre[0] = pp->rpre[0] = 0;
+	for (k = 0; k < pp->nblocks; k++) {
+		s = k * pp->bs;
+		e = k == pp->nblocks - 1 ? pp->m : s + pp->bs;
+		p = s + pp->nlt[k];
+		/* Not less than the pivot, in [p, min(e, lt)). */
+		pp->lpre[k + 1] = pp->lpre[k] + (min(e, lt) > p ? min(e, lt) - p : 0);
+		/* Less than the pivot, in [max(s, lt), p). */
+		s = s > lt ? s : lt;
+		pp->rpre[k + 1] = pp->rpre[k] + (p > s ? p - s : 0);
+	}
+	assert(pp->lpre[pp->nblocks] == pp->rpre[pp->nblocks]);
+	pp->lt = lt;
+	pp->nchunks = (pp->lpre[pp->nblocks] + pp->bs - 1) / pp->bs;
+}
+
+/* The block holding misplaced element i according to prefix sums pre. */
+static size_t ppart_seg(const size_t *pre, size_t nblocks, size_t i)
+{
+	size_t lo = 0, hi = nblocks, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (pre[mid] <= i)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Phase 2 of ppart(): swap misplaced elements until none are left. */
+static bool ppart_fixup(struct ppart *pp)
+{
+	struct common *c = pp->c;
+	size_t es = c->es;
+	int swaptype = c->swaptype;
+	size_t k, i, j, kl, kr, ls, rs, len, nmis = pp->lpre[pp->nblocks];
+	bool claimed = false;
+
+	while ((k = atomic_fetch_add_explicit(&pp->next_chunk, 1,
+		memory_order_relaxed)) < pp->nchunks) {
+		i = k * pp->bs;
+		j = min(i + pp->bs, nmis);
+		kl = ppart_seg(pp->lpre, pp->nblocks, i);
+		kr = ppart_seg(pp->rpre, pp->nblocks, i);
+		while (i < j) {
+			while (pp->lpre[kl + 1] <= i)
+				kl++;
+			while (pp->rpre[kr + 1] <= i)
+				kr++;
+			ls = kl * pp->bs + pp->nlt[kl] + (i - pp->lpre[kl]);
+			rs = (kr * pp->bs > pp->lt ? kr * pp->bs : pp->lt) +
+				(i - pp->rpre[kr]);
+			len = min(min(pp->lpre[kl + 1], pp->rpre[kr + 1]), j) - i;
+			vecswap(pp->base + ls * es, pp->base + rs * es, len * es);
+			i += len;
+		}
+		atomic_fetch_add_explicit(&pp->chunks_done, 1, memory_order_release);
+		claimed = true;
+	}
+	return claimed;
+}
+
+/* Wait for the other participants of a ppart() to catch up. */
+static void ppart_wait(atomic_size_t *done, size_t n)
+{
+	while (atomic_load_explicit(done, memory_order_acquire) < n)
+		sched_yield();
+}
+
+/* Partition the n - 1 elements following the pivot at a with the help of
+ * idle pool threads. Returns the number of elements less than the pivot,
+ * which then come right after it.
+ */
+static size_t ppart(struct qsort *qs, struct common *c, char *a, size_t n)
+{
+	struct qsort_mt_ctx *ctx = qs->ctx;
+	struct ppart *pp = &qs->pp;
+	size_t split = (size_t) PPART_SPLIT * ctx->nthreads;
+
+	pp->c = c;
+	pp->pivot = a;
+	pp->base = a + c->es;
+	pp->m = n - 1;
+	pp->bs = (pp->m + split - 1) / split;
+	if (pp->bs < PPART_BLOCK)
+		pp->bs = PPART_BLOCK;
+	pp->nblocks = (pp->m + pp->bs - 1) / pp->bs;
+	atomic_store_explicit(&pp->next_block, 0, memory_order_relaxed);
+	atomic_store_explicit(&pp->blocks_done, 0, memory_order_relaxed);
+	atomic_store_explicit(&pp->next_chunk, 0, memory_order_relaxed);
+	atomic_store_explicit(&pp->chunks_done, 0, memory_order_relaxed);
+	atomic_store_explicit(&pp->phase, 1, memory_order_relaxed);
+	atomic_store_explicit(&pp->open, true, memory_order_seq_cst);
+	/* As in fork_task(). */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ctx->nsleeping, memory_order_relaxed) > 0)
+		wake_threads(ctx, true);
+
+	ppart_blocks(pp);
+	ppart_wait(&pp->blocks_done, pp->nblocks);
+	ppart_plan(pp);
+	atomic_store_explicit(&pp->phase, 2, memory_order_release);
+	ppart_fixup(pp);
+	ppart_wait(&pp->chunks_done, pp->nchunks);
+
+	/* Pairs with help_partition(): either a helper sees the slot closed,
+	 * or we wait for it to leave.
+	 */
+	atomic_store_explicit(&pp->open, false, memory_order_seq_cst);
+	while (atomic_load_explicit(&pp->active, memory_order_seq_cst) > 0)
+		sched_yield();
+	return pp->lt;
+}
+
+bool qsort_mt_ppart(struct qsort *qs, void *a, size_t n, size_t *lt)
+{
+	struct common *c;
+
+	if (qs == NULL)
+		return false;
+	c = qs->c;
+	if (n < c->ppart_min)
+		return false;
+	*lt = ppart(qs, c, a, n);
+	return true;
+}
+
+/* Join a partition led by another thread, if there is one. */
+static bool help_partition(struct qsort *qs)
+{
+	struct qsort_mt_ctx *ctx = qs->ctx;
+	bool helped = false, claimed;
+	struct ppart *pp;
+	double t;
+
+	for (int i = 0; i < ctx->nthreads; i++) {
+		pp = &ctx->pool[i].pp;
+		if (pp == &qs->pp ||
+			!atomic_load_explicit(&pp->open, memory_order_relaxed))
+			continue;
+		atomic_fetch_add_explicit(&pp->active, 1, memory_order_seq_cst);
+		if (atomic_load_explicit(&pp->open, memory_order_seq_cst)) {
+			t = now();
+			claimed = ppart_blocks(pp);
+			while (atomic_load_explicit(&pp->phase, memory_order_acquire) == 1)
+				sched_yield();
+			/* Not if all that was left was waiting for the leader. */
+			if (ppart_fixup(pp) || claimed) {
+				qs->st.busy += now() - t;
+				qs->st.helped++;
+				stats_flush(qs);
+			}
+			helped = true;
+		}
+		atomic_fetch_sub_explicit(&pp->active, 1, memory_order_release);
+	}
+	return helped;
+}
+
+/* Moves allowed for insertion sorting a part its partition left as is. */
+#define QSORT_PARTIAL 8
+
+/* Restore the heap property of the n elements at a below element k. */
+static void qsort_sift(struct common *c, char *a, size_t k, size_t n)
+{
+	size_t es = c->es, j;
+	int swaptype = c->swaptype;
+	cmp_t *cmp = c->cmp;
+
+	while ((j = 2 * k + 1) < n) {
+		if (j + 1 < n && CMP(thunk, a + j * es, a + (j + 1) * es) < 0)
+			j++;
+		if (CMP(thunk, a + k * es, a + j * es) >= 0)
+			break;
+		swap(a + k * es, a + j * es);
+		k = j;
+	}
+}
+
+/* Heapsort, for parts quicksort keeps splitting badly. */
+static void qsort_heap(struct common *c, char *a, size_t n)
+{
+	size_t es = c->es, i;
+	int swaptype = c->swaptype;
+
+	for (i = n / 2; i-- > 0;)
+		qsort_sift(c, a, i, n);
+	for (i = n; i-- > 1;) {
+		swap(a, a + i * es);
+		qsort_sift(c, a, 0, i);
+	}
+}
+
+/* Pick a pivot for the n elements at a, at least 7, and partition them
+ * around it, together with other pool threads if *par is set and n large
+ * enough. The *nl elements less than the pivot end up at the front and the
+ * *nr greater ones at the back, those equal to it in between. A cooperative
+ * partition leaves all but the pivot itself to the right and clears *par if
+ * its split is lopsided. Returns false if the sequential partition moved
+ * nothing, which hints at sorted input.
+ */
+static bool qsort_partition(struct qsort *qs,
+	struct common *c,
+	char *a,
+	size_t n,
+	bool *par,
+	size_t *nl,
+	size_t *nr)
+{
+	char *pa, *pb, *pc, *pd, *pl, *pm, *pn;
+	int swaptype = c->swaptype;
+	size_t es = c->es, d, r;
+	cmp_t *cmp = c->cmp;
+	bool swapped = false;
+	int cr;
+
+	if (qs)
+		qs->st.partitions++;
+	pm = a + (n / 2) * es;
+	if (n > 7) {
+		pl = a;
+		pn = a + (n - 1) * es;
+		if (n > 40) {
+			d = (n / 8) * es;
+			pl = med3(pl, pl + d, pl + 2 * d, cmp, thunk);
+			pm = med3(pm - d, pm, pm + d, cmp, thunk);
+			pn = med3(pn - 2 * d, pn - d, pn, cmp, thunk);
+		}
+		pm = med3(pl, pm, pn, cmp, thunk);
+	}
+	swap(a, pm);
+	if (*par && n >= c->ppart_min) {
+		r = ppart(qs, c, a, n);
+		swap(a, a + r * es);
+		*nl = r;
+		*nr = n - 1 - r;
+		/* A lopsided split usually means many keys equal to the pivot,
+		 * which the sequential three-way partition takes care of.
+		 */
+		*par = min(r, n - 1 - r) >= n / 16;
+		return true;
+	}
+	*par = true;
+	pa = pb = a + es;
+
+	pc = pd = a + (n - 1) * es;
+	for (;;) {
+		while (pb <= pc && (cr = CMP(thunk, pb, a)) <= 0) {
+			if (cr == 0) {
+				swapped = true;
+				swap(pa, pb);
+				pa += es;
+			}
+			pb += es;
+		}
+		while (pb <= pc && (cr = CMP(thunk, pc, a)) >= 0) {
+			if (cr == 0) {
+				swapped = true;
+				swap(pc, pd);
+				pd -= es;
+			}
+			pc -= es;
+		}
+		if (pb > pc)
+			break;
+		swap(pb, pc);
+		swapped = true;
+		pb += es;
+		pc -= es;
+	}
+
+	pn = a + n * es;
+	r = min(pa - a, pb - pa);
+	vecswap(a, pb - r, r);
+	r = min(pd - pc, pn - pd - es);
+	vecswap(pb, pn - r, r);
+	*nl = (pb - pa) / es;
+	*nr = (pd - pc) / es;
+	return swapped;
+}
+
+/* Shuffle some elements of a badly unbalanced split of the n elements at a
+ * around, to break up the pattern that caused it. Returns whether it was.
+ */
+static bool qsort_unbalanced(struct common *c,
+	char *a,
+	size_t n,
+	size_t nl,
+	size_t nr)
+{
+	char *pr = a + (n - nr) * c->es;
+	int swaptype = c->swaptype;
+	size_t es = c->es;
+
+	if (max(nl, nr) <= n - n / 8)
+		return false;
+	if (nl > 7) {
+		swap(a, a + nl / 4 * es);
+		swap(a + (nl - 1) * es, a + (nl - nl / 4) * es);
+	}
+	if (nr > 7) {
+		swap(pr, pr + nr / 4 * es);
+		swap(pr + (nr - 1) * es, pr + (nr - nr / 4) * es);
+	}
+	return true;
+}
+
+/* Insertion sort of the n elements at a. Gives up, returning false, after
+ * limit moves.
+ */
+static bool qsort_insertion(struct common *c, char *a, size_t n, size_t limit)
+{
+	int swaptype = c->swaptype;
+	size_t es = c->es, moves = 0;
+	cmp_t *cmp = c->cmp;
+	char *pl, *pm;
+
+	for (pm = a + es; pm < a + n * es; pm += es)
+		for (pl = pm; pl > a && CMP(thunk, pl - es, pl) > 0; pl -= es) {
+			swap(pl, pl - es);
+			if (++moves > limit)
+				return false;
+		}
+	return true;
+}
+
+/* Thread-callable quicksort of n elements at a. Once bad unbalanced
+ * partitions have been seen, the rest is heapsorted, which bounds the
+ * running time by O(n log n), as in introsort (Musser) and pdqsort (Peters).
+ */
+static void qsort_algo(struct qsort *qs,
+	struct common *c,
+	void *a,
+	size_t n,
+	int bad)
+{
+	bool par = true; /* Partition cooperatively if large enough. */
+	size_t nl, nr, t;
+	char *pl, *pr;
+
+	if (qs->depth > qs->st.max_depth)
+		qs->st.max_depth = qs->depth;
+top:
+	if (n < 7) {
+		qsort_insertion(c, a, n, SIZE_MAX);
+		return;
+	}
+	if (bad == 0) {
+		qsort_heap(c, a, n);
+		return;
+	}
+	/* Insertion sort what partitioning left as is, if that takes only a
+	 * few moves, as for (nearly) sorted input.
+	 */
+	if (!qsort_partition(qs, c, a, n, &par, &nl, &nr) &&
+		qsort_insertion(c, a, n, QSORT_PARTIAL))
+		return;
+	if (qsort_unbalanced(c, a, n, nl, nr))
+		bad--;
+
+	/* Now let other threads steal the smaller part, if it is worth it,
+	 * and carry on with the larger one. Parts sorted by recursion are thus
+	 * at most half as large as their parent, which bounds the depth of the
+	 * stack by log n.
+	 */
+	pl = a;
+	pr = (char *) a + (n - nr) * c->es;
+	if (nl > nr) {
+		pl = pr;
+		pr = a;
+		t = nl;
+		nl = nr;
+		nr = t;
+	}
+	if (nl > 0 && (nl <= (size_t) c->forkelem || !fork_task(qs, c, pl, nl, bad, false))) {
+		qs->depth++;
+		qsort_algo(qs, c, pl, nl, bad);
+		qs->depth--;
+	}
+	a = pr;
+	n = nr;
+	goto top;
+}
+
+static void qsort_task(struct qsort *qs, void *a, size_t n, int bad,
+	bool pred)
+{
+	(void) pred;
+	qsort_algo(qs, qs->c, a, n, bad);
+}
+
+/* Pool thread: sort tasks as they come, park when there are none. */
+static void *qsort_thread(void *p)
+{
+	struct qsort *qs = p;
+	struct qsort_mt_ctx *ctx = qs->ctx;
+	struct common *c;
+	struct task task;
+	unsigned int seq;
+	double t;
+	int i;
+
+	for (;;) {
+		if (help_partition(qs))
+			continue;
+		if (find_task(qs, &task)) {
+			c = qs->c = task.c;
+			t = now();
+			c->task(qs, task.a, task.n, task.bad, task.pred);
+			qs->st.busy += now() - t;
+			qs->st.tasks++;
+			stats_flush(qs);
+			/* Once done is 1, c may be gone; waking its address in
+			 * vain is harmless.
+			 */
+			if (atomic_fetch_sub_explicit(&c->pending, 1,
+				memory_order_acq_rel) == 1 &&
+				atomic_exchange_explicit(&c->done, 1,
+					memory_order_release) == 2)
+				/* That was the last one, the caller sleeps. */
+				futex_wake(&c->done, 1);
+			continue;
+		}
+
+		if (atomic_load(&ctx->term))
+			return NULL;
+		/* Work often turns up right away, when a busy thread forks or
+		 * the next sort starts.
+		 */
+		if (ctx->spin) {
+			for (i = 0; i < PARK_SPIN && !any_task(ctx); i++)
+				cpu_relax();
+			if (i < PARK_SPIN)
+				continue;
+		}
+		seq = atomic_load(&ctx->work_seq);
+
+		/* Announce that we are going to sleep, then look once more, so
+		 * that a task pushed meanwhile is either seen here or causes a
+		 * wakeup in fork_task(), which bumps work_seq.
+		 */
+		atomic_fetch_add_explicit(&ctx->nsleeping, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!any_task(ctx) && !atomic_load(&ctx->term))
+			futex_wait(&ctx->work_seq, seq);
+		atomic_fetch_sub_explicit(&ctx->nsleeping, 1, memory_order_relaxed);
+	}
+}
+
+/* Sorts other than quicksort run in phases, each of which calls a function
+ * on every chunk of the array. A phase runs on the pool as a sort whose
+ * task splits the array in halves, handing them off to other threads, down
+ * to single chunks. The chunks are the same in every phase.
+ */
+struct pfor {
+	struct common c;        /* First, the pool only knows about this. */
+	char *base;             /* The array, its chunks are counted from here. */
+	char *src, *dst;        /* Elements before and after the current phase. */
+	size_t n;
+	size_t chunk;           /* Elements per chunk. */
+	size_t nchunks;
+	void (*fn)(struct pfor *pf, size_t i);
+};
+
+/* Number of elements in chunk i. */
+static inline size_t pfor_len(struct pfor *pf, size_t i)
+{
+	return min(pf->chunk, pf->n - i * pf->chunk);
+}
+
+static void pfor_task(struct qsort *qs, void *a, size_t n, int bad,
+	bool pred)
+{
+	struct pfor *pf = (struct pfor *) qs->c;
+	size_t es = pf->c.es, nl;
+
+	while (n > pf->chunk) {
+		nl = (n + pf->chunk - 1) / pf->chunk / 2 * pf->chunk;
+		if (!fork_task(qs, &pf->c, (char *) a + nl * es, n - nl, bad, pred))
+			pfor_task(qs, (char *) a + nl * es, n - nl, bad, pred);
+		n = nl;
+	}
+	pf->fn(pf, ((char *) a - pf->base) / es / pf->chunk);
+}
+
+/* Cut the n elements of es bytes at a into about split chunks of at least
+ * minchunk elements.
+ */
+static void pfor_init(struct pfor *pf,
+	void *a,
+	size_t n,
+	size_t es,
+	size_t split,
+	size_t minchunk)
+{
+	pf->c.es = es;
+	pf->c.swaptype = swap_type(a, es);
+	pf->c.task = pfor_task;
+	pf->c.part = NULL;
+	pf->base = pf->src = a;
+	pf->dst = NULL;
+	pf->n = n;
+	pf->chunk = max((n + split - 1) / split, minchunk);
+	pf->nchunks = (n + pf->chunk - 1) / pf->chunk;
+}
+
+/* Run a phase, on the calling thread if ctx is NULL. */
+static void pfor_run(struct qsort_mt_ctx *ctx,
+	struct pfor *pf,
+	void (*fn)(struct pfor *pf, size_t i))
+{
+	pf->fn = fn;
+	if (ctx == NULL || pf->nchunks == 1) {
+		for (size_t i = 0; i < pf->nchunks; i++)
+			fn(pf, i);
+		return;
+	}
+	ctx_run(ctx, &pf->c, pf->base, pf->n, 0);
+}
+
+static void pfor_copy(struct pfor *pf, size_t i)
+{
+	size_t es = pf->c.es, off = i * pf->chunk * es;
+
+	memcpy(pf->dst + off, pf->src + off, pfor_len(pf, i) * es);
+}
+
+/* Minimum number of bytes per chunk of qsort_mt_ctx_touch(). */
+#define TOUCH_CHUNK (1 << 16)
+
+static void pfor_zero(struct pfor *pf, size_t i)
+{
+	memset(pf->src + i * pf->chunk, 0, pfor_len(pf, i));
+}
+
+void qsort_mt_ctx_touch(struct qsort_mt_ctx *ctx, void *a, size_t size)
+{
+	struct pfor pf;
+
+	if (size == 0)
+		return;
+	/* One chunk per thread, for the memory to be spread evenly. */
+	pfor_init(&pf, a, size, 1, ctx->nthreads, TOUCH_CHUNK);
+	pfor_run(ctx, &pf, pfor_zero);
+}
+
+/* Radix sort, see qsort_mt_radix(). The per chunk digit counts of one
+ * phase give the scatter offsets of the next.
+ */
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+/* Minimum number of keys per chunk. */
+#define RADIX_CHUNK (1 << 14)
+/* Maximum number of chunks per pool thread. */
+#define RADIX_SPLIT 4
+
+struct radix {
+	struct pfor pf;         /* First, see struct pfor. */
+	unsigned int shift;     /* Of the digit of the current pass. */
+	size_t *count;          /* Per chunk and digit, RADIX_BUCKETS apart. */
+};
+
+/* Unsigned keys ordered like the elements. */
+static inline uint32_t radix_key_u32(uint32_t x)
+{
+	return x;
+}
+
+static inline uint64_t radix_key_u64(uint64_t x)
+{
+	return x;
+}
+
+static inline uint32_t radix_key_float(float x)
+{
+	uint32_t u;
+
+	memcpy(&u, &x, sizeof(u));
+	if (x != x)
+		return UINT32_MAX;
+	return u >> 31 ? ~u : u | (uint32_t) 1 << 31;
+}
+
+static inline uint64_t radix_key_double(double x)
+{
+	uint64_t u;
+
+	memcpy(&u, &x, sizeof(u));
+	if (x != x)
+		return UINT64_MAX;
+	return u >> 63 ? ~u : u | (uint64_t) 1 << 63;
+}
+
+/* Generates the phase functions for one key type: counting the digits of
+ * chunk i, and scattering it to dst.
+ */
+#define RADIX_DEFINE(name, T)                                                 \
+static void radix_count_##name(struct pfor *pf, size_t i)                     \
+{                                                                             \
+	struct radix *r = (struct radix *) pf;                                    \
+	size_t *count = r->count + i * RADIX_BUCKETS;                             \
+	const T *a = (const T *) pf->src + i * pf->chunk;                         \
+	size_t j, n = pfor_len(pf, i);                                            \
+                                                                              \
+	memset(count, 0, RADIX_BUCKETS * sizeof(*count));                         \
+	for (j = 0; j < n; j++)                                                   \
+		count[(radix_key_##name(a[j]) >> r->shift) & (RADIX_BUCKETS - 1)]++;  \
+}                                                                             \
+                                                                              \
+static void radix_scatter_##name(struct pfor *pf, size_t i)                   \
+{                                                                             \
+	enum { WC = CACHE_LINE / sizeof(T) };                                     \
+	_Alignas(CACHE_LINE) T buf[RADIX_BUCKETS][WC];                            \
+	unsigned char fill[RADIX_BUCKETS] = { 0 };                                \
+	struct radix *r = (struct radix *) pf;                                    \
+	size_t *off = r->count + i * RADIX_BUCKETS;                               \
+	const T *a = (const T *) pf->src + i * pf->chunk;                         \
+	T *dst = (T *) pf->dst;                                                   \
+	size_t j, d, n = pfor_len(pf, i);                                         \
+                                                                              \
+	for (j = 0; j < n; j++) {                                                 \
+		d = (radix_key_##name(a[j]) >> r->shift) & (RADIX_BUCKETS - 1);       \
+		buf[d][fill[d]++] = a[j];                                             \
+		if (fill[d] == WC) {                                                  \
+			memcpy(dst + off[d], buf[d], sizeof(buf[d]));                     \
+			off[d] += WC;                                                     \
+			fill[d] = 0;                                                      \
+		}                                                                     \
+	}                                                                         \
+	for (d = 0; d < RADIX_BUCKETS; d++)                                       \
+		memcpy(dst + off[d], buf[d], fill[d] * sizeof(T));                    \
+}
+
+RADIX_DEFINE(u32, uint32_t)
+RADIX_DEFINE(u64, uint64_t)
+RADIX_DEFINE(float, float)
+RADIX_DEFINE(double, double)
+
+static const struct {
+	size_t es;
+	void (*count)(struct pfor *pf, size_t i);
+	void (*scatter)(struct pfor *pf, size_t i);
+} radix_types[] = {
+	[QSORT_MT_U32] = { 4, radix_count_u32, radix_scatter_u32 },
+	[QSORT_MT_U64] = { 8, radix_count_u64, radix_scatter_u64 },
+	[QSORT_MT_FLOAT] = { 4, radix_count_float, radix_scatter_float },
+	[QSORT_MT_DOUBLE] = { 8, radix_count_double, radix_scatter_double },
+};
+
+bool qsort_mt_ctx_radix(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	enum qsort_mt_key key)
+{
+	struct radix r;
+	struct pfor *pf = &r.pf;
+	size_t i, d, off, start, t;
+	bool skip;
+	char *tmp;
+
+	if (n < QSORT_MT_RADIX_MIN)
+		return false;
+	pfor_init(pf, a, n, radix_types[key].es,
+		ctx ? (size_t) RADIX_SPLIT * ctx->nthreads : 1, RADIX_CHUNK);
+	if ((pf->dst = malloc(n * pf->c.es)) == NULL)
+		return false;
+	if ((r.count = malloc(pf->nchunks * RADIX_BUCKETS * sizeof(size_t))) ==
+		NULL) {
+		free(pf->dst);
+		return false;
+	}
+
+	for (r.shift = 0; r.shift < pf->c.es * CHAR_BIT; r.shift += RADIX_BITS) {
+		pfor_run(ctx, pf, radix_types[key].count);
+
+		/* Turn the counts into offsets, chunk by chunk within a digit. */
+		off = 0;
+		skip = false;
+		for (d = 0; d < RADIX_BUCKETS; d++) {
+			for (i = 0, start = off; i < pf->nchunks; i++) {
+				t = r.count[i * RADIX_BUCKETS + d];
+				r.count[i * RADIX_BUCKETS + d] = off;
+				off += t;
+			}
+			/* All keys share this digit, nothing would move. */
+			if (off - start == n)
+				skip = true;
+		}
+		if (skip)
+			continue;
+		pfor_run(ctx, pf, radix_types[key].scatter);
+		tmp = pf->src;
+		pf->src = pf->dst;
+		pf->dst = tmp;
+	}
+	/* The keys may have ended up in the scratch space. */
+	if (pf->src != a) {
+		pfor_run(ctx, pf, pfor_copy);
+		pf->dst = pf->src;
+	}
+	free(pf->dst);
+	free(r.count);
+	return true;
+}
+
+bool qsort_mt_radix(void *a, size_t n, enum qsort_mt_key key, int maxthreads)
+{
+	struct qsort_mt_ctx *ctx = NULL;
+	bool sorted, tuned = maxthreads == QSORT_MT_AUTO;
+
+	maxthreads = tune_threads(maxthreads, n, radix_types[key].es);
+	/* Tuned down to no threads, radix sort still beats the others. */
+	if (n < QSORT_MT_RADIX_MIN || (maxthreads < 1 && !tuned))
+		return false;
+	if (maxthreads > 0 && (ctx = qsort_mt_ctx_create(maxthreads)) == NULL)
+		return false;
+	sorted = qsort_mt_ctx_radix(ctx, a, n, key);
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+	return sorted;
+}
+
+/* Merge sort, see mergesort_mt(). The first phase sorts each chunk on its
+ * own. Every further phase merges pairs of sorted runs twice as long as
+ * those of the previous one, the run length being a multiple of the chunk
+ * size. Each chunk of the output of a merge is produced independently: the
+ * number of elements it takes from either run is found by binary search
+ * (merge path, Odeh et al.; co-ranking, Siebert & Träff).
+ */
+
+/* Minimum number of elements per chunk. */
+#define MSORT_CHUNK (1 << 12)
+/* Maximum number of chunks per pool thread. */
+#define MSORT_SPLIT 4
+/* Runs insertion sorted before merging starts within a chunk. */
+#define MSORT_RUN 16
+
+struct msort {
+	struct pfor pf;         /* First, see struct pfor. */
+	size_t run;             /* Length of the sorted runs in src. */
+};
+
+#define copy(a, b)                                \
+    do {                                          \
+        if (swaptype == 0)                        \
+            *(long *) (a) = *(const long *) (b);  \
+        else                                      \
+            memcpy(a, b, es);                     \
+    } while (0)
+
+/* Stable merge of the nl elements at l and the nr at r into out. */
+static void msort_merge(struct common *c,
+	const char *l,
+	size_t nl,
+	const char *r,
+	size_t nr,
+	char *out)
+{
+	size_t es = c->es;
+	int swaptype = c->swaptype;
+	cmp_t *cmp = c->cmp;
+
+	while (nl > 0 && nr > 0) {
+		if (CMP(thunk, r, l) < 0) {
+			copy(out, r);
+			r += es;
+			nr--;
+		} else {
+			copy(out, l);
+			l += es;
+			nl--;
+		}
+		out += es;
+	}
+	memcpy(out, l, nl * es);
+	memcpy(out + nl * es, r, nr * es);
+}
+
+/* The number of elements of l among the first k of the stable merge of l
+ * and r.
+ */
+static size_t msort_corank(struct common *c,
+	size_t k,
+	const char *l,
+	size_t nl,
+	const char *r,
+	size_t nr)
+{
+	size_t es = c->es, lo, hi, i;
+	cmp_t *cmp = c->cmp;
+
+	lo = k > nr ? k - nr : 0;
+	hi = min(k, nl);
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		/* l[i] belongs among the first k, unless r[k - i - 1] is
+		 * strictly less.
+		 */
+		if (CMP(thunk, r + (k - i - 1) * es, l + i * es) >= 0)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	return lo;
+}
+
+/* Phase 1: sort chunk i of src stably, using the same part of dst. */
+static void msort_chunk(struct pfor *pf, size_t i)
+{
+	struct common *c = &pf->c;
+	size_t es = c->es, n = pfor_len(pf, i), k, w;
+	int swaptype = c->swaptype;
+	cmp_t *cmp = c->cmp;
+	char *a = pf->src + i * pf->chunk * es, *b = pf->dst + i * pf->chunk * es;
+	char *pl, *pm, *t;
+
+	for (k = 0; k < n; k += MSORT_RUN)
+		for (pm = a + (k + 1) * es; pm < a + min(k + MSORT_RUN, n) * es;
+			pm += es)
+			for (pl = pm; pl > a + k * es && CMP(thunk, pl - es, pl) > 0;
+				pl -= es)
+				swap(pl, pl - es);
+	for (w = MSORT_RUN; w < n; w *= 2) {
+		for (k = 0; k < n; k += 2 * w)
+			msort_merge(c, a + k * es, min(w, n - k), a + (k + w) * es,
+				n - k > w ? min(w, n - k - w) : 0, b + k * es);
+		t = a;
+		a = b;
+		b = t;
+	}
+	if (a != pf->src + i * pf->chunk * es)
+		memcpy(b, a, n * es);
+}
+
+/* Further phases: produce chunk i of dst. */
+static void msort_merge_chunk(struct pfor *pf, size_t i)
+{
+	struct msort *m = (struct msort *) pf;
+	struct common *c = &pf->c;
+	size_t es = c->es, o = i * pf->chunk, ps, nl, nr, lo, hi, il, ih;
+	const char *l, *r;
+
+	/* The pair of runs the chunk is merged from. */
+	ps = o / (2 * m->run) * (2 * m->run);
+	nl = min(m->run, pf->n - ps);
+	nr = min(2 * m->run, pf->n - ps) - nl;
+	l = pf->src + ps * es;
+	r = l + nl * es;
+	lo = o - ps;
+	hi = lo + pfor_len(pf, i);
+	il = msort_corank(c, lo, l, nl, r, nr);
+	ih = msort_corank(c, hi, l, nl, r, nr);
+	msort_merge(c, l + il * es, ih - il, r + (lo - il) * es,
+		(hi - ih) - (lo - il), pf->dst + o * es);
+}
+
+int mergesort_mt_ctx(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int forkelem)
+{
+	struct msort m;
+	struct pfor *pf = &m.pf;
+	char *tmp;
+
+	forkelem = tune_forkelem(forkelem, es);
+	if (n < 2)
+		return 0;
+	pfor_init(pf, a, n, es,
+		ctx ? (size_t) MSORT_SPLIT * ctx->nthreads : 1,
+		max((size_t) MSORT_CHUNK, (size_t) forkelem));
+	pf->c.cmp = cmp;
+	if ((pf->dst = malloc(n * es)) == NULL)
+		return -1;
+
+	pfor_run(ctx, pf, msort_chunk);
+	for (m.run = pf->chunk; m.run < n; m.run *= 2) {
+		pfor_run(ctx, pf, msort_merge_chunk);
+		tmp = pf->src;
+		pf->src = pf->dst;
+		pf->dst = tmp;
+	}
+	/* The elements may have ended up in the scratch space. */
+	if (pf->src != a) {
+		pfor_run(ctx, pf, pfor_copy);
+		pf->dst = pf->src;
+	}
+	free(pf->dst);
+	return 0;
+}
+
+int mergesort_mt(void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, es, maxthreads, &forkelem);
+	int ret;
+
+	ret = mergesort_mt_ctx(ctx, a, n, es, cmp, forkelem);
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+	return ret;
+}
+
+/* Merge into a sorted array, see qsort_mt_append(). Once the new elements
+ * are sorted, only the old ones greater than the least new one and the new
+ * ones less than the greatest old one move. They are merged into scratch
+ * space in chunks produced independently, as by mergesort_mt(), and copied
+ * back.
+ */
+
+struct amerge {
+	struct pfor pf;         /* First, see struct pfor. */
+	const char *l, *r;      /* The old and the new elements merged. */
+	size_t nl, nr;
+};
+
+/* Produce chunk i of dst. */
+static void amerge_chunk(struct pfor *pf, size_t i)
+{
+	struct amerge *m = (struct amerge *) pf;
+	struct common *c = &pf->c;
+	size_t es = c->es, lo = i * pf->chunk, hi = lo + pfor_len(pf, i), il, ih;
+
+	il = msort_corank(c, lo, m->l, m->nl, m->r, m->nr);
+	ih = msort_corank(c, hi, m->l, m->nl, m->r, m->nr);
+	msort_merge(c, m->l + il * es, ih - il, m->r + (lo - il) * es,
+		(hi - ih) - (lo - il), pf->dst + lo * es);
+}
+
+int qsort_mt_ctx_append(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int forkelem)
+{
+	struct amerge m;
+	struct pfor *pf = &m.pf;
+	char *old = a, *new, *tmp;
+	size_t lo, hi, mid;
+
+	forkelem = tune_forkelem(forkelem, es);
+	k = min(k, n);
+	if (k == 0)
+		return 0;
+	new = old + (n - k) * es;
+	if (ctx)
+		qsort_mt_ctx_sort(ctx, new, k, es, cmp, forkelem);
+	else
+		qsort(new, k, es, cmp);
+	/* Appended in order, as happens with increasing keys. */
+	if (k == n || cmp(new - es, new) <= 0)
+		return 0;
+
+	/* Old elements not greater than the least new one stay. */
+	for (lo = 0, hi = n - k; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (cmp(old + mid * es, new) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	m.l = old += lo * es;
+	m.nl = n - k - lo;
+	/* So do new ones not less than the greatest old one. */
+	for (lo = 0, hi = k; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (cmp(new + mid * es, new - es) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	m.r = new;
+	m.nr = lo;
+
+	pfor_init(pf, old, m.nl + m.nr, es,
+		ctx ? (size_t) MSORT_SPLIT * ctx->nthreads : 1,
+		max((size_t) MSORT_CHUNK, (size_t) forkelem));
+	pf->c.cmp = cmp;
+	if ((pf->dst = malloc(pf->n * es)) == NULL)
+		return -1;
+	pfor_run(ctx, pf, amerge_chunk);
+	tmp = pf->src;
+	pf->src = pf->dst;
+	pf->dst = tmp;
+	pfor_run(ctx, pf, pfor_copy);
+	free(pf->src);
+	return 0;
+}
+
+int qsort_mt_append(void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, es, maxthreads, &forkelem);
+	int ret;
+
+	ret = qsort_mt_ctx_append(ctx, a, n, es, k, cmp, forkelem);
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+	return ret;
+}
+
+/* String sort, see qsort_mt_str(). Multikey quicksort (Bentley & Sedgewick)
+ * on an array of string pointers, each next to a cached key: the 8 bytes of
+ * its string from the depth of its part on, as a big-endian number padded
+ * with zeros after the end of the string. Partitioning compares keys only.
+ * Elements with the pivot's key share 8 more bytes; their keys are reloaded
+ * further down the strings and they form a part of their own, unless the
+ * strings end within the key, which makes them equal (Rantala; Bingmann,
+ * caching multikey quicksort).
+ */
+
+/* Parts of this many strings or fewer are insertion sorted. */
+#define STR_SMALL 16
+/* Minimum number of strings per chunk when loading and storing keys. */
+#define STR_CHUNK (1 << 14)
+/* Maximum number of such chunks per pool thread. */
+#define STR_SPLIT 4
+
+struct strkey {
+	uint64_t key;
+	char *s;
+};
+
+struct strsort {
+	struct common c;        /* First, the pool only knows about this. */
+	struct strkey *base;
+	/* Depth of a forked part, at the index of its first element. Only
+	 * those entries are written, the rest is never touched.
+	 */
+	size_t *depth;
+};
+
+static inline uint64_t str_key(const char *s, size_t d)
+{
+	const unsigned char *p = (const unsigned char *) s + d;
+	uint64_t k = 0;
+	int i;
+
+	for (i = 0; i < 8 && p[i]; i++)
+		k |= (uint64_t) p[i] << (56 - 8 * i);
+	return k;
+}
+
+/* strcmp() of the strings, which are equal up to depth d. */
+static inline int str_cmp(const struct strkey *x,
+	const struct strkey *y,
+	size_t d)
+{
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	/* Equal keys of strings ending within them. */
+	if ((x->key & 0xff) == 0)
+		return 0;
+	return strcmp(x->s + d + 8, y->s + d + 8);
+}
+
+static inline void str_swap(struct strkey *a, size_t i, size_t j)
+{
+	struct strkey t = a[i];
+
+	a[i] = a[j];
+	a[j] = t;
+}
+
+static void str_vecswap(struct strkey *a, size_t i, size_t j, size_t n)
+{
+	while (n-- > 0)
+		str_swap(a, i++, j++);
+}
+
+static inline size_t str_med3(struct strkey *a, size_t i, size_t j, size_t k)
+{
+	return a[i].key < a[j].key
+		? (a[j].key < a[k].key ? j : (a[i].key < a[k].key ? k : i))
+		: (a[k].key < a[j].key ? j : (a[i].key < a[k].key ? i : k));
+}
+
+static void str_insertion(struct strkey *a, size_t n, size_t d)
+{
+	size_t i, j;
+	struct strkey t;
+
+	for (i = 1; i < n; i++) {
+		t = a[i];
+		for (j = i; j > 0 && str_cmp(&a[j - 1], &t, d) > 0; j--)
+			a[j] = a[j - 1];
+		a[j] = t;
+	}
+}
+
+static void str_sift(struct strkey *a, size_t k, size_t n, size_t d)
+{
+	size_t j;
+
+	while ((j = 2 * k + 1) < n) {
+		if (j + 1 < n && str_cmp(&a[j], &a[j + 1], d) < 0)
+			j++;
+		if (str_cmp(&a[k], &a[j], d) >= 0)
+			break;
+		str_swap(a, k, j);
+		k = j;
+	}
+}
+
+/* Parts that keep splitting badly are heapsorted, as in qsort_algo(). */
+static void str_heap(struct strkey *a, size_t n, size_t d)
+{
+	size_t i;
+
+	for (i = n / 2; i-- > 0;)
+		str_sift(a, i, n, d);
+	for (i = n; i-- > 1;) {
+		str_swap(a, 0, i);
+		str_sift(a, 0, i, d);
+	}
+}
+
+static void str_algo(struct qsort *qs,
+	struct strsort *ss,
+	struct strkey *a,
+	size_t n,
+	size_t d,
+	int bad);
+
+/* Sort the part of n elements at a, on another thread if it is worth it. */
+static void str_part(struct qsort *qs,
+	struct strsort *ss,
+	struct strkey *a,
+	size_t n,
+	size_t d,
+	int bad)
+{
+	if (n < 2)
+		return;
+	if (qs && n > (size_t) ss->c.forkelem) {
+		ss->depth[a - ss->base] = d;
+		if (fork_task(qs, &ss->c, a, n, bad, false))
+			return;
+	}
+	str_algo(qs, ss, a, n, d, bad);
+}
+
+static void str_algo(struct qsort *qs,
+	struct strsort *ss,
+	struct strkey *a,
+	size_t n,
+	size_t d,
+	int bad)
+{
+	size_t pa, pb, pc, pd, nl, nr, ne, r, i, s;
+	struct {
+		struct strkey *a;
+		size_t n, d;
+	} part[3], t;
+	uint64_t v;
+
+top:
+	if (n <= STR_SMALL) {
+		str_insertion(a, n, d);
+		return;
+	}
+	if (bad == 0) {
+		str_heap(a, n, d);
+		return;
+	}
+
+	pb = n / 2;
+	if (n > 40) {
+		s = n / 8;
+		pa = str_med3(a, 0, s, 2 * s);
+		pb = str_med3(a, pb - s, pb, pb + s);
+		pc = str_med3(a, n - 1 - 2 * s, n - 1 - s, n - 1);
+		pb = str_med3(a, pa, pb, pc);
+	} else
+		pb = str_med3(a, 0, pb, n - 1);
+	str_swap(a, 0, pb);
+	v = a[0].key;
+
+	/* Split-end partition: keys equal to the pivot go to both ends
+	 * first, and to the middle at the end.
+	 */
+	pa = pb = 1;
+	pc = pd = n - 1;
+	for (;;) {
+		while (pb <= pc && a[pb].key <= v) {
+			if (a[pb].key == v)
+				str_swap(a, pa++, pb);
+			pb++;
+		}
+		while (pb <= pc && a[pc].key >= v) {
+			if (a[pc].key == v)
+				str_swap(a, pc, pd--);
+			pc--;
+		}
+		if (pb > pc)
+			break;
+		str_swap(a, pb++, pc--);
+	}
+	r = min(pa, pb - pa);
+	str_vecswap(a, 0, pb - r, r);
+	r = min(pd - pc, n - 1 - pd);
+	str_vecswap(a, pb, n - r, r);
+	nl = pb - pa;
+	nr = pd - pc;
+	ne = n - nl - nr;
+
+	if (max(nl, nr) > n - n / 8)
+		bad--;
+	part[0].a = a;
+	part[0].n = nl;
+	part[0].d = d;
+	part[1].a = a + nl;
+	part[1].n = ne;
+	part[1].d = d + 8;
+	part[2].a = a + n - nr;
+	part[2].n = nr;
+	part[2].d = d;
+	if (v & 0xff) {
+		for (i = 0; i < ne; i++)
+			part[1].a[i].key = str_key(part[1].a[i].s, d + 8);
+	} else
+		part[1].n = 0;
+
+	/* Loop on the largest part, so the others are at most half of n. */
+	for (i = 1; i < 3; i++)
+		if (part[i].n > part[0].n) {
+			t = part[0];
+			part[0] = part[i];
+			part[i] = t;
+		}
+	str_part(qs, ss, part[1].a, part[1].n, part[1].d, bad);
+	str_part(qs, ss, part[2].a, part[2].n, part[2].d, bad);
+	a = part[0].a;
+	n = part[0].n;
+	d = part[0].d;
+	goto top;
+}
+
+static void str_task(struct qsort *qs, void *a, size_t n, int bad,
+	bool pred)
+{
+	struct strsort *ss = (struct strsort *) qs->c;
+	struct strkey *k = a;
+
+	(void) pred;
+	str_algo(qs, ss, k, n, ss->depth[k - ss->base], bad);
+}
+
+static void str_load(struct pfor *pf, size_t i)
+{
+	char **s = (char **) pf->src + i * pf->chunk;
+	struct strkey *k = (struct strkey *) pf->dst + i * pf->chunk;
+	size_t j, n = pfor_len(pf, i);
+
+	for (j = 0; j < n; j++) {
+		k[j].key = str_key(s[j], 0);
+		k[j].s = s[j];
+	}
+}
+
+static void str_store(struct pfor *pf, size_t i)
+{
+	char **s = (char **) pf->src + i * pf->chunk;
+	struct strkey *k = (struct strkey *) pf->dst + i * pf->chunk;
+	size_t j, n = pfor_len(pf, i);
+
+	for (j = 0; j < n; j++)
+		s[j] = k[j].s;
+}
+
+bool qsort_mt_ctx_str(struct qsort_mt_ctx *ctx,
+	char **a,
+	size_t n,
+	int forkelem)
+{
+	struct strsort ss;
+	struct pfor pf;
+
+	forkelem = tune_forkelem(forkelem, sizeof(*a));
+	if (n < 2)
+		return true;
+	pfor_init(&pf, a, n, sizeof(*a),
+		ctx ? (size_t) STR_SPLIT * ctx->nthreads : 1, STR_CHUNK);
+	if ((ss.base = malloc(n * sizeof(*ss.base))) == NULL)
+		return false;
+	if ((ss.depth = malloc(n * sizeof(*ss.depth))) == NULL) {
+		free(ss.base);
+		return false;
+	}
+	pf.dst = (char *) ss.base;
+
+	pfor_run(ctx, &pf, str_load);
+	ss.depth[0] = 0;
+	ss.c.es = sizeof(*ss.base);
+	ss.c.task = str_task;
+	ss.c.part = NULL;
+	if (ctx && n >= (size_t) forkelem)
+		ctx_run(ctx, &ss.c, ss.base, n, forkelem);
+	else
+		str_algo(NULL, &ss, ss.base, n, 0, qsort_mt_log2(n));
+	pfor_run(ctx, &pf, str_store);
+
+	free(ss.base);
+	free(ss.depth);
+	return true;
+}
+
+bool qsort_mt_str(char **a, size_t n, int maxthreads, int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, sizeof(*a), maxthreads,
+		&forkelem);
+	bool sorted;
+
+	sorted = qsort_mt_ctx_str(ctx, a, n, forkelem);
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+	return sorted;
+}
+
+/* Indirect sorts, see qsort_mt_indirect() and qsort_mt_sort_by_key(). The
+ * (key, index) pairs are sorted by the inlined quicksort, the index making
+ * every key distinct and the sort stable. The permutation is then applied
+ * to each array by gathering it, chunk by chunk of the output, into scratch
+ * space, and copying it back.
+ */
+
+/* Minimum number of elements per chunk. */
+#define PERM_CHUNK (1 << 12)
+/* Maximum number of chunks per pool thread. */
+#define PERM_SPLIT 4
+/* Elements looked ahead when gathering. */
+#define PERM_PREFETCH 8
+
+struct kv {
+	uint64_t key;
+	size_t idx;
+};
+
+#define KV_LESS(x, y) \
+	((x).key < (y).key || ((x).key == (y).key && (x).idx < (y).idx))
+
+QSORT_MT_DEFINE(kv_sort, struct kv, KV_LESS)
+
+struct perm {
+	struct pfor pf;         /* First, see struct pfor. */
+	struct kv *kv;
+	qsort_mt_key_t *key;
+};
+
+static void perm_keys(struct pfor *pf, size_t i)
+{
+	struct perm *p = (struct perm *) pf;
+	size_t es = pf->c.es, j = i * pf->chunk, end = j + pfor_len(pf, i);
+	const char *a = pf->src;
+
+	for (; j < end; j++) {
+		p->kv[j].key = p->key ? p->key(a + j * es) : ((uint64_t *) a)[j];
+		p->kv[j].idx = j;
+	}
+}
+
+static void perm_store_keys(struct pfor *pf, size_t i)
+{
+	struct perm *p = (struct perm *) pf;
+	size_t j = i * pf->chunk, end = j + pfor_len(pf, i);
+
+	for (; j < end; j++)
+		((uint64_t *) pf->src)[j] = p->kv[j].key;
+}
+
+static void perm_gather(struct pfor *pf, size_t i)
+{
+	struct perm *p = (struct perm *) pf;
+	size_t es = pf->c.es, j = i * pf->chunk, end = j + pfor_len(pf, i);
+	const char *a = pf->src;
+	char *out = pf->dst;
+
+	for (; j < end; j++) {
+		if (j + PERM_PREFETCH < end)
+			__builtin_prefetch(a + p->kv[j + PERM_PREFETCH].idx * es);
+		memcpy(out + j * es, a + p->kv[j].idx * es, es);
+	}
+}
+
+/* Point the phases at the n elements of es bytes at a. */
+static void perm_array(struct perm *p, void *a, size_t es)
+{
+	p->pf.base = p->pf.src = a;
+	p->pf.c.es = es;
+	p->pf.c.swaptype = swap_type(a, es);
+}
+
+/* Apply the sorted permutation to the n elements of es bytes at a. */
+static void perm_apply(struct qsort_mt_ctx *ctx,
+	struct perm *p,
+	void *a,
+	size_t es,
+	char *tmp)
+{
+	perm_array(p, a, es);
+	p->pf.dst = tmp;
+	pfor_run(ctx, &p->pf, perm_gather);
+	p->pf.src = tmp;
+	p->pf.dst = a;
+	pfor_run(ctx, &p->pf, pfor_copy);
+}
+
+/* Sort the pairs of key(a[i]), or ((uint64_t *) a)[i] without key, and i. */
+static int perm_sort(struct qsort_mt_ctx *ctx,
+	struct perm *p,
+	void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_key_t *key,
+	int forkelem)
+{
+	pfor_init(&p->pf, a, n, es,
+		ctx ? (size_t) PERM_SPLIT * ctx->nthreads : 1, PERM_CHUNK);
+	if ((p->kv = malloc(n * sizeof(*p->kv))) == NULL)
+		return -1;
+	p->key = key;
+	pfor_run(ctx, &p->pf, perm_keys);
+	if (ctx)
+		kv_sort_ctx(ctx, p->kv, n, forkelem);
+	else
+		kv_sort(p->kv, n, 0, forkelem);
+	return 0;
+}
+
+int qsort_mt_ctx_indirect(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_key_t *key,
+	int forkelem)
+{
+	struct perm p;
+	char *tmp;
+
+	forkelem = tune_forkelem(forkelem, sizeof(struct kv));
+	if (n < 2)
+		return 0;
+	if ((tmp = malloc(n * es)) == NULL)
+		return -1;
+	if (perm_sort(ctx, &p, a, n, es, key, forkelem)) {
+		free(tmp);
+		return -1;
+	}
+	perm_apply(ctx, &p, a, es, tmp);
+	free(p.kv);
+	free(tmp);
+	return 0;
+}
+
+int qsort_mt_ctx_sort_by_key(struct qsort_mt_ctx *ctx,
+	uint64_t *keys,
+	size_t n,
+	void *const *vals,
+	const size_t *es,
+	int nvals,
+	int forkelem)
+{
+	struct perm p;
+	size_t maxes = 0;
+	char *tmp;
+	int i;
+
+	forkelem = tune_forkelem(forkelem, sizeof(struct kv));
+	if (n < 2)
+		return 0;
+	for (i = 0; i < nvals; i++)
+		maxes = max(maxes, es[i]);
+	if ((tmp = malloc(n * maxes)) == NULL && maxes > 0)
+		return -1;
+	if (perm_sort(ctx, &p, keys, n, sizeof(*keys), NULL, forkelem)) {
+		free(tmp);
+		return -1;
+	}
+	for (i = 0; i < nvals; i++)
+		perm_apply(ctx, &p, vals[i], es[i], tmp);
+	perm_array(&p, keys, sizeof(*keys));
+	pfor_run(ctx, &p.pf, perm_store_keys);
+	free(p.kv);
+	free(tmp);
+	return 0;
+}
+
+int qsort_mt_indirect(void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_key_t *key,
+	int maxthreads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, sizeof(struct kv), maxthreads,
+		&forkelem);
+	int ret;
+
+	ret = qsort_mt_ctx_indirect(ctx, a, n, es, key, forkelem);
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+	return ret;
+}
+
+int qsort_mt_sort_by_key(uint64_t *keys,
+	size_t n,
+	void *const *vals,
+	const size_t *es,
+	int nvals,
+	int maxthreads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, sizeof(struct kv), maxthreads,
+		&forkelem);
+	int ret;
+
+	ret = qsort_mt_ctx_sort_by_key(ctx, keys, n, vals, es, nvals, forkelem);
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+	return ret;
+}
+
+/* Selection, see qselect_mt(). Quickselect partitions like qsort_algo(),
+ * large parts cooperatively, but only carries on with the part holding
+ * position k. A partial sort then quicksorts the elements before k. Its
+ * first task is the selection, which forks nothing, so any later one is a
+ * part of those elements.
+ */
+struct select {
+	struct common c;        /* First, the pool only knows about this. */
+	size_t k;
+	bool sort;              /* Sort the elements before k too. */
+	bool selected;          /* Tasks are parts of the elements before k. */
+};
+
+static void qselect_algo(struct qsort *qs,
+	struct common *c,
+	char *a,
+	size_t n,
+	size_t k,
+	int bad)
+{
+	bool par = true;
+	size_t nl, nr;
+
+	while (n >= 7) {
+		if (bad == 0) {
+			qsort_heap(c, a, n);
+			return;
+		}
+		qsort_partition(qs, c, a, n, &par, &nl, &nr);
+		if (qsort_unbalanced(c, a, n, nl, nr))
+			bad--;
+		if (k < nl)
+			n = nl;
+		else if (k >= n - nr) {
+			a += (n - nr) * c->es;
+			k -= n - nr;
+			n = nr;
+		} else
+			return;         /* Equal to the pivot. */
+	}
+	qsort_insertion(c, a, n, SIZE_MAX);
+}
+
+static void select_task(struct qsort *qs, void *a, size_t n, int bad,
+	bool pred)
+{
+	struct select *s = (struct select *) qs->c;
+
+	(void) pred;
+	if (s->selected) {
+		qsort_algo(qs, &s->c, a, n, bad);
+		return;
+	}
+	s->selected = true;
+	qselect_algo(qs, &s->c, a, n, s->k, bad);
+	if (s->sort)
+		qsort_algo(qs, &s->c, a, s->k, qsort_mt_log2(s->k));
+}
+
+static void select_run(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int forkelem,
+	bool sort)
+{
+	struct select s;
+
+	forkelem = tune_forkelem(forkelem, es);
+	s.c.es = es;
+	s.c.cmp = cmp;
+	s.c.task = select_task;
+	s.c.part = qsort_part;
+	s.k = k;
+	s.sort = sort;
+	s.selected = false;
+	if (ctx == NULL || n < (size_t) forkelem) {
+		s.c.swaptype = swap_type(a, es);
+		s.c.ppart_min = SIZE_MAX;
+		qselect_algo(NULL, &s.c, a, n, k, qsort_mt_log2(n));
+		if (sort)
+			qsort(a, k, es, cmp);
+		return;
+	}
+	ctx_run(ctx, &s.c, a, n, forkelem);
+}
+
+void qselect_mt_ctx(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int forkelem)
+{
+	if (k < n)
+		select_run(ctx, a, n, es, k, cmp, forkelem, false);
+}
+
+void partial_sort_mt_ctx(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int forkelem)
+{
+	if (k >= n) {
+		if (ctx)
+			qsort_mt_ctx_sort(ctx, a, n, es, cmp, forkelem);
+		else
+			qsort(a, n, es, cmp);
+	} else if (k > 0)
+		select_run(ctx, a, n, es, k, cmp, forkelem, true);
+}
+
+void qselect_mt(void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, es, maxthreads, &forkelem);
+
+	qselect_mt_ctx(ctx, a, n, es, k, cmp, forkelem);
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+}
+
+void partial_sort_mt(void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem)
+{
+	struct qsort_mt_ctx *ctx = sort_pool(n, es, maxthreads, &forkelem);
+
+	partial_sort_mt_ctx(ctx, a, n, es, k, cmp, forkelem);
+	if (ctx)
+		qsort_mt_ctx_destroy(ctx);
+}
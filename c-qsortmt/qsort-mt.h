@@ -0,0 +1,630 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef int cmp_t(const void *, const void *);
+
+/* Sort n elements of es bytes at a, like qsort(3), using a pool of
+ * maxthreads threads created for this call only. Parts of forkelem
+ * elements or fewer are never offered to other threads. Falls back to
+ * qsort(3) when the pool cannot be set up.
+ */
+void qsort_mt(void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem);
+
+/* Passed as forkelem, or as maxthreads, to any of the sorts, or as the
+ * number of threads of a context, derives them from the element size, the
+ * cache size, the number of processors and the measured cost of handing
+ * a part off to another thread. Threads are only started for a single
+ * sort if n gives several parts worth a handoff to each of them.
+ */
+#define QSORT_MT_AUTO (-1)
+
+/* Measure the costs QSORT_MT_AUTO is based on, or read them from the file
+ * at path if it holds an earlier measurement, writing them there if not.
+ * Happens on the first use of QSORT_MT_AUTO, with the file named by the
+ * environment variable QSORT_MT_TUNE, if set, unless called before. Returns
+ * -1 with errno set if they can be neither read nor measured and written.
+ */
+int qsort_mt_calibrate(const char *path);
+
+/* A long-lived sorting context. Its threads are created once and park
+ * between sorts, so back-to-back sorts pay for neither thread creation
+ * nor synchronization object setup. Sorts started on a context by several
+ * callers at once, or submitted without waiting, share its threads.
+ */
+struct qsort_mt_ctx;
+
+/* Returns NULL with errno set when the threads cannot be created. */
+struct qsort_mt_ctx *qsort_mt_ctx_create(int nthreads);
+
+/* Like qsort_mt_ctx_create(), but pin thread i to CPU cpus[i % ncpus]. Idle
+ * threads then steal work from threads on their own NUMA node first.
+ */
+struct qsort_mt_ctx *qsort_mt_ctx_create_pinned(int nthreads,
+	const int *cpus,
+	int ncpus);
+
+/* Zero size bytes at a on all threads of ctx. Used on freshly allocated
+ * memory, this places its pages evenly on the NUMA nodes of the threads,
+ * rather than all on the node of the thread that first writes to it.
+ */
+void qsort_mt_ctx_touch(struct qsort_mt_ctx *ctx, void *a, size_t size);
+
+void qsort_mt_ctx_sort(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int forkelem);
+
+/* Start sorting like qsort_mt_ctx_sort() and return at once with a handle
+ * to the sort, or NULL with errno set if none can be allocated. The caller
+ * may poll the handle, and must eventually wait for it, which frees it. The
+ * elements at a must not be touched in the meantime.
+ */
+struct qsort_mt_job;
+
+struct qsort_mt_job *qsort_mt_submit(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int forkelem);
+
+/* Returns true once the sort of job is complete. */
+bool qsort_mt_poll(struct qsort_mt_job *job);
+
+void qsort_mt_wait(struct qsort_mt_job *job);
+
+/* Every sort on ctx must be complete. */
+void qsort_mt_ctx_destroy(struct qsort_mt_ctx *ctx);
+
+/* What one thread of a context did since the context was created or its
+ * statistics were last reset. Comparisons and swaps of the generic sorts
+ * are only counted when the library is built with QSORT_MT_STATS, as
+ * counting them slows sorting down.
+ */
+struct qsort_mt_stats {
+	uint64_t tasks;      /* Tasks run. */
+	uint64_t steals;     /* Tasks taken from other threads. */
+	uint64_t forks;      /* Parts offered to other threads. */
+	uint64_t inlined;    /* Parts sorted here as the deque was full. */
+	uint64_t partitions; /* Quicksort partitioning steps. */
+	uint64_t helped;     /* Partitions led by others joined. */
+	uint64_t cmps;
+	uint64_t swaps;
+	int max_depth;       /* Deepest quicksort recursion within a task. */
+	double busy;         /* Seconds running tasks or helping partition, */
+	double idle;         /* and looking for work or parked. */
+};
+
+/* Store the statistics of up to nst threads of ctx in st and return the
+ * number of threads. No sort may be in progress on ctx.
+ */
+int qsort_mt_ctx_stats(struct qsort_mt_ctx *ctx,
+	struct qsort_mt_stats *st,
+	int nst);
+
+void qsort_mt_ctx_stats_reset(struct qsort_mt_ctx *ctx);
+
+/* Write the statistics of n threads, their total and the load imbalance,
+ * the busy time of the busiest thread over the mean, as JSON.
+ */
+void qsort_mt_stats_json(const struct qsort_mt_stats *st, int n, FILE *f);
+
+/* Rearrange the n elements at a so that the one at index k is the one a
+ * sort would put there, with none greater before it and none less after
+ * it, like std::nth_element. Quickselect, which partitions only the part
+ * holding index k, large parts together with other pool threads. Nothing
+ * happens for a k of n or more.
+ */
+void qselect_mt(void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem);
+
+void qselect_mt_ctx(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int forkelem);
+
+/* Sort the k least of the n elements at a into its first k, leaving the
+ * others in no particular order after them, like std::partial_sort.
+ */
+void partial_sort_mt(void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem);
+
+void partial_sort_mt_ctx(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int forkelem);
+
+/* Stable sort, elements that compare equal keep their order. Chunks of the
+ * array are sorted in parallel and then merged pairwise in rounds, every
+ * merge being cut into equal parts of the output that pool threads produce
+ * independently. Chunks have at least forkelem elements. Needs scratch space
+ * for n elements and returns -1 with errno set, leaving a untouched, when it
+ * cannot be had, 0 otherwise. Without a pool, from mergesort_mt() with a
+ * maxthreads of 0 or a NULL ctx, the merge sort runs on the calling thread.
+ */
+int mergesort_mt(void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem);
+
+int mergesort_mt_ctx(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	cmp_t *cmp,
+	int forkelem);
+
+/* Sort the n elements at a, the first n - k of which are sorted already and
+ * the last k new, as by sorting just the new ones and merging them into the
+ * old ones, which costs O(k log k + n) instead of O(n log n). The old
+ * elements greater than the least new one and the new ones less than the
+ * greatest old one are merged as by mergesort_mt(), equal old ones going
+ * first, which needs scratch space for them. Returns -1 with errno set,
+ * the new elements sorted but not merged, when it cannot be had, 0
+ * otherwise. Without a pool, the sort and merge run on the calling thread.
+ */
+int qsort_mt_append(void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int maxthreads,
+	int forkelem);
+
+int qsort_mt_ctx_append(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	size_t k,
+	cmp_t *cmp,
+	int forkelem);
+
+/*
+ * Type-specialized sorts. QSORT_MT_DEFINE(name, T, less) generates
+ *
+ *	void name(T *a, size_t n, int maxthreads, int forkelem);
+ *	void name##_ctx(struct qsort_mt_ctx *ctx, T *a, size_t n, int forkelem);
+ *
+ * which work like qsort_mt() and qsort_mt_ctx_sort(), except that less(x, y),
+ * a macro or inline function on two values of type T that must be a strict
+ * weak order, is inlined into the sort and elements are moved as T rather
+ * than byte by byte. The functions are static inline, so no code is emitted
+ * for instances that are never called. Instances for the common scalar
+ * types, which switch to radix sort for large inputs, follow below.
+ *
+ * The generated code runs on the same thread pool as qsort_mt() through the
+ * interface below, which is not meant to be used directly. A sort is a task
+ * function, called for each part to sort with the calling pool thread, or
+ * with NULL when the caller sorts on its own, and a block partition
+ * function, which moves the elements of a less than the element at pivot to
+ * the front and returns their count. The task function is also passed the
+ * number of bad partitions the part may still take, log2 n for the whole
+ * array, and whether an element not greater than any of it precedes it,
+ * both as forked with the part.
+ */
+struct qsort;
+
+typedef void qsort_mt_task_t(struct qsort *qs,
+	void *a,
+	size_t n,
+	int bad,
+	bool pred);
+typedef size_t qsort_mt_part_t(void *a, size_t n, const void *pivot,
+	void *arg);
+
+void qsort_mt_run(void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_task_t *task,
+	qsort_mt_part_t *part,
+	int maxthreads,
+	int forkelem);
+
+void qsort_mt_ctx_run(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_task_t *task,
+	qsort_mt_part_t *part,
+	int forkelem);
+
+/* Offer n elements at a to other threads, to be passed to the task
+ * function with bad and pred. Returns false if the caller has to sort them
+ * itself.
+ */
+bool qsort_mt_fork(struct qsort *qs, void *a, size_t n, int bad, bool pred);
+
+/* Partition the n - 1 elements after the pivot at a together with other
+ * pool threads and store the number of them less than the pivot in *lt.
+ * Returns false, without touching a, if n is too small to be worth it.
+ */
+bool qsort_mt_ppart(struct qsort *qs, void *a, size_t n, size_t *lt);
+
+/* floor(log2(n)), 0 for n = 0 */
+static inline int qsort_mt_log2(size_t n)
+{
+	int l = 0;
+
+	while (n >>= 1)
+		l++;
+	return l;
+}
+
+/* Parts of this many elements or fewer are sorted by a sorting network. */
+#define QSORT_MT_SMALL 16
+/* Elements per block of the branchless partition, at most 256. */
+#define QSORT_MT_BLOCK 64
+
+#define QSORT_MT_DEFINE(name, T, less)                                       \
+static inline size_t name##_med3(T *a, size_t i, size_t j, size_t k)         \
+{                                                                            \
+	return less(a[i], a[j])                                                  \
+		? (less(a[j], a[k]) ? j : (less(a[i], a[k]) ? k : i))                \
+		: (less(a[k], a[j]) ? j : (less(a[i], a[k]) ? i : k));               \
+}                                                                            \
+                                                                             \
+static inline void name##_swap(T *a, size_t i, size_t j)                     \
+{                                                                            \
+	T t = a[i];                                                              \
+                                                                             \
+	a[i] = a[j];                                                             \
+	a[j] = t;                                                                \
+}                                                                            \
+                                                                             \
+static inline void name##_cswap(T *a, size_t i, size_t j)                    \
+{                                                                            \
+	T x = a[i], y = a[j];                                                    \
+	bool c = less(y, x);                                                     \
+                                                                             \
+	a[i] = c ? y : x;                                                        \
+	a[j] = c ? x : y;                                                        \
+}                                                                            \
+                                                                             \
+/* Batcher's merge exchange (Knuth, TAOCP 5.2.2, Algorithm M). */            \
+static inline void name##_network(T *a, size_t n)                            \
+{                                                                            \
+	size_t t, p, q, r, d, i;                                                 \
+                                                                             \
+	if (n < 2)                                                               \
+		return;                                                              \
+	for (t = 1; (size_t) 1 << t < n; t++)                                    \
+		;                                                                    \
+	for (p = (size_t) 1 << (t - 1); p > 0; p >>= 1) {                        \
+		q = (size_t) 1 << (t - 1);                                           \
+		r = 0;                                                               \
+		d = p;                                                               \
+		for (;;) {                                                           \
+			for (i = 0; i + d < n; i++)                                      \
+				if ((i & p) == r)                                            \
+					name##_cswap(a, i, i + d);                               \
+			if (q == p)                                                      \
+				break;                                                       \
+			d = q - p;                                                       \
+			q >>= 1;                                                         \
+			r = p;                                                           \
+		}                                                                    \
+	}                                                                        \
+}                                                                            \
+                                                                             \
+static inline void name##_sift(T *a, size_t k, size_t n)                     \
+{                                                                            \
+	size_t j;                                                                \
+	T t = a[k];                                                              \
+                                                                             \
+	while ((j = 2 * k + 1) < n) {                                            \
+		if (j + 1 < n && less(a[j], a[j + 1]))                               \
+			j++;                                                             \
+		if (!less(t, a[j]))                                                  \
+			break;                                                           \
+		a[k] = a[j];                                                         \
+		k = j;                                                               \
+	}                                                                        \
+	a[k] = t;                                                                \
+}                                                                            \
+                                                                             \
+static inline void name##_heap(T *a, size_t n)                               \
+{                                                                            \
+	size_t i;                                                                \
+                                                                             \
+	for (i = n / 2; i-- > 0;)                                                \
+		name##_sift(a, i, n);                                                \
+	for (i = n; i-- > 1;) {                                                  \
+		name##_swap(a, 0, i);                                                \
+		name##_sift(a, 0, i);                                                \
+	}                                                                        \
+}                                                                            \
+                                                                             \
+/* Moves the elements less than p to the front and returns their count. */   \
+static inline size_t name##_bpart(T *a, size_t n, T p)                       \
+{                                                                            \
+	unsigned char offl[QSORT_MT_BLOCK], offr[QSORT_MT_BLOCK];                \
+	size_t l = 0, r = n, nl = 0, nr = 0, sl = 0, sr = 0, i, m;               \
+	T t;                                                                     \
+                                                                             \
+	while (r - l > 2 * QSORT_MT_BLOCK) {                                     \
+		if (nl == 0) {                                                       \
+			sl = 0;                                                          \
+			for (i = 0; i < QSORT_MT_BLOCK; i++) {                           \
+				offl[nl] = i;                                                \
+				nl += !less(a[l + i], p);                                    \
+			}                                                                \
+		}                                                                    \
+		if (nr == 0) {                                                       \
+			sr = 0;                                                          \
+			for (i = 0; i < QSORT_MT_BLOCK; i++) {                           \
+				offr[nr] = i;                                                \
+				nr += less(a[r - 1 - i], p);                                 \
+			}                                                                \
+		}                                                                    \
+		m = nl < nr ? nl : nr;                                               \
+		for (i = 0; i < m; i++) {                                            \
+			t = a[l + offl[sl + i]];                                         \
+			a[l + offl[sl + i]] = a[r - 1 - offr[sr + i]];                   \
+			a[r - 1 - offr[sr + i]] = t;                                     \
+		}                                                                    \
+		nl -= m;                                                             \
+		nr -= m;                                                             \
+		sl += m;                                                             \
+		sr += m;                                                             \
+		if (nl == 0)                                                         \
+			l += QSORT_MT_BLOCK;                                             \
+		if (nr == 0)                                                         \
+			r -= QSORT_MT_BLOCK;                                             \
+	}                                                                        \
+	/* The rest, which may include a block with misplaced elements. */       \
+	for (i = l; i < r; i++) {                                                \
+		t = a[i];                                                            \
+		a[i] = a[l];                                                         \
+		a[l] = t;                                                            \
+		l += less(t, p);                                                     \
+	}                                                                        \
+	return l;                                                                \
+}                                                                            \
+                                                                             \
+static inline size_t name##_part(void *base, size_t n, const void *pivot,    \
+	void *arg)                                                               \
+{                                                                            \
+	(void) arg;                                                              \
+	return name##_bpart(base, n, *(const T *) pivot);                        \
+}                                                                            \
+                                                                             \
+/* Pattern-defeating quicksort (Peters). With pred, a[-1] is not greater     \
+ * than any element of a. After bad badly unbalanced partitions the rest is  \
+ * heapsorted.                                                               \
+ */                                                                          \
+static inline void name##_pdq(struct qsort *qs, T *a, size_t n, int bad,     \
+	bool pred)                                                               \
+{                                                                            \
+	size_t i, d, lt, nb;                                                     \
+	T p, t, *b;                                                              \
+                                                                             \
+	while (n > QSORT_MT_SMALL) {                                             \
+		if (bad == 0) {                                                      \
+			name##_heap(a, n);                                               \
+			return;                                                          \
+		}                                                                    \
+		i = n / 2;                                                           \
+		if (n > 40) {                                                        \
+			d = n / 8;                                                       \
+			i = name##_med3(a, name##_med3(a, 0, d, 2 * d),                  \
+				name##_med3(a, i - d, i, i + d),                             \
+				name##_med3(a, n - 1 - 2 * d, n - 1 - d, n - 1));            \
+		} else                                                               \
+			i = name##_med3(a, 0, i, n - 1);                                 \
+		name##_swap(a, 0, i);                                                \
+		p = a[0];                                                            \
+		/* The pivot equals the predecessor: all keys equal to it are        \
+		 * in place once moved to the front.                                 \
+		 */                                                                  \
+		if (pred && !less(a[-1], p)) {                                       \
+			for (i = d = 1; i < n; i++) {                                    \
+				t = a[i];                                                    \
+				a[i] = a[d];                                                 \
+				a[d] = t;                                                    \
+				d += !less(p, t);                                            \
+			}                                                                \
+			a += d;                                                          \
+			n -= d;                                                          \
+			continue;                                                        \
+		}                                                                    \
+		if (!qsort_mt_ppart(qs, a, n, &lt))                                  \
+			lt = name##_bpart(a + 1, n - 1, p);                              \
+		name##_swap(a, 0, lt);                                               \
+		b = a + lt + 1;                                                      \
+		nb = n - 1 - lt;                                                     \
+		/* Shuffle some elements of a badly unbalanced split around, to      \
+		 * break up the pattern that caused it, and count it.                \
+		 */                                                                  \
+		if ((lt > nb ? lt : nb) > n - n / 8) {                               \
+			bad--;                                                           \
+			if (lt > QSORT_MT_SMALL) {                                       \
+				name##_swap(a, 0, lt / 4);                                   \
+				name##_swap(a, lt - 1, lt - lt / 4);                         \
+			}                                                                \
+			if (nb > QSORT_MT_SMALL) {                                       \
+				name##_swap(b, 0, nb / 4);                                   \
+				name##_swap(b, nb - 1, nb - nb / 4);                         \
+			}                                                                \
+		}                                                                    \
+		/* Hand off or recurse on the smaller part, which bounds the         \
+		 * depth of the stack by log n, and carry on with the larger.        \
+		 */                                                                  \
+		if (lt < nb) {                                                       \
+			if (lt > 0 && !qsort_mt_fork(qs, a, lt, bad, pred))              \
+				name##_pdq(qs, a, lt, bad, pred);                            \
+			a = b;                                                           \
+			n = nb;                                                          \
+			pred = true;                                                     \
+		} else {                                                             \
+			if (nb > 0 && !qsort_mt_fork(qs, b, nb, bad, true))              \
+				name##_pdq(qs, b, nb, bad, true);                            \
+			n = lt;                                                          \
+		}                                                                    \
+	}                                                                        \
+	name##_network(a, n);                                                    \
+}                                                                            \
+                                                                             \
+static inline void name##_algo(struct qsort *qs, void *a, size_t n, int bad, \
+	bool pred)                                                               \
+{                                                                            \
+	name##_pdq(qs, a, n, bad, pred);                                         \
+}                                                                            \
+                                                                             \
+static inline void name(T *a, size_t n, int maxthreads, int forkelem)        \
+{                                                                            \
+	qsort_mt_run(a, n, sizeof(T), name##_algo, name##_part, maxthreads,      \
+		forkelem);                                                           \
+}                                                                            \
+                                                                             \
+static inline void name##_ctx(struct qsort_mt_ctx *ctx, T *a, size_t n,      \
+	int forkelem)                                                            \
+{                                                                            \
+	qsort_mt_ctx_run(ctx, a, n, sizeof(T), name##_algo, name##_part,         \
+		forkelem);                                                           \
+}
+
+#define QSORT_MT_LESS(x, y) ((x) < (y))
+/* Like QSORT_MT_LESS, but a strict weak order with NaNs, which go last. */
+#define QSORT_MT_FLT_LESS(x, y) ((x) < (y) || ((y) != (y) && (x) == (x)))
+
+/*
+ * Parallel LSD radix sort of scalar keys, one byte per pass. Each pass
+ * counts the digits of every chunk of the keys in parallel, turns the
+ * counts into per chunk offsets and scatters the chunks in parallel through
+ * cache line sized write-combining buffers. Passes over a digit all keys
+ * share are skipped. The keys are sorted in ascending order, floating point
+ * ones as by QSORT_MT_FLT_LESS.
+ *
+ * Returns false, leaving a untouched, if n is below QSORT_MT_RADIX_MIN, where
+ * comparison sorts win, or if the scratch space of n keys radix sort needs
+ * cannot be had.
+ */
+enum qsort_mt_key {
+	QSORT_MT_U32,
+	QSORT_MT_U64,
+	QSORT_MT_FLOAT,
+	QSORT_MT_DOUBLE,
+};
+
+#define QSORT_MT_RADIX_MIN (1 << 16)
+
+bool qsort_mt_radix(void *a, size_t n, enum qsort_mt_key key, int maxthreads);
+
+bool qsort_mt_ctx_radix(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	enum qsort_mt_key key);
+
+/* Like QSORT_MT_DEFINE, but radix sorting large inputs. T must be the type
+ * of key, and QSORT_MT_DEFINE(name##_cmp, T, less) must come first.
+ */
+#define QSORT_MT_DEFINE_RADIX(name, T, key)                                  \
+static inline void name(T *a, size_t n, int maxthreads, int forkelem)        \
+{                                                                            \
+	if (!qsort_mt_radix(a, n, key, maxthreads))                              \
+		name##_cmp(a, n, maxthreads, forkelem);                              \
+}                                                                            \
+                                                                             \
+static inline void name##_ctx(struct qsort_mt_ctx *ctx, T *a, size_t n,      \
+	int forkelem)                                                            \
+{                                                                            \
+	if (!qsort_mt_ctx_radix(ctx, a, n, key))                                 \
+		name##_cmp_ctx(ctx, a, n, forkelem);                                 \
+}
+
+QSORT_MT_DEFINE(qsort_mt_u32_cmp, uint32_t, QSORT_MT_LESS)
+QSORT_MT_DEFINE(qsort_mt_u64_cmp, uint64_t, QSORT_MT_LESS)
+QSORT_MT_DEFINE(qsort_mt_float_cmp, float, QSORT_MT_FLT_LESS)
+QSORT_MT_DEFINE(qsort_mt_double_cmp, double, QSORT_MT_FLT_LESS)
+QSORT_MT_DEFINE_RADIX(qsort_mt_u32, uint32_t, QSORT_MT_U32)
+QSORT_MT_DEFINE_RADIX(qsort_mt_u64, uint64_t, QSORT_MT_U64)
+QSORT_MT_DEFINE_RADIX(qsort_mt_float, float, QSORT_MT_FLOAT)
+QSORT_MT_DEFINE_RADIX(qsort_mt_double, double, QSORT_MT_DOUBLE)
+
+/* Sort n strings at a in strcmp(3) order, by multikey quicksort on keys of
+ * 8 bytes cached next to the string pointers, so that most comparisons
+ * touch neither the strings nor bytes already known to be equal. Needs
+ * scratch space for 3 pointers per string and returns false, leaving a
+ * untouched, when it cannot be had. Without a pool, from qsort_mt_str()
+ * with a maxthreads of 0 or a NULL ctx, the sort runs on the calling thread.
+ */
+bool qsort_mt_str(char **a, size_t n, int maxthreads, int forkelem);
+
+bool qsort_mt_ctx_str(struct qsort_mt_ctx *ctx,
+	char **a,
+	size_t n,
+	int forkelem);
+
+/* Sorts that move every element once. They sort (key, index) pairs and
+ * then permute the elements accordingly, gathering them in parallel into
+ * scratch space of n elements, which pays off for large elements. The order
+ * is that of the unsigned keys, with equal keys in their original order.
+ * Both return -1 with errno set, leaving the arrays untouched, when scratch
+ * space cannot be had, 0 otherwise, and run on the calling thread without a
+ * pool.
+ *
+ * qsort_mt_indirect() sorts n elements of es bytes at a by key(a + i * es).
+ */
+typedef uint64_t qsort_mt_key_t(const void *);
+
+int qsort_mt_indirect(void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_key_t *key,
+	int maxthreads,
+	int forkelem);
+
+int qsort_mt_ctx_indirect(struct qsort_mt_ctx *ctx,
+	void *a,
+	size_t n,
+	size_t es,
+	qsort_mt_key_t *key,
+	int forkelem);
+
+/* Sort the n keys and, in the same order, the nvals arrays of n values of
+ * es[i] bytes at vals[i] each.
+ */
+int qsort_mt_sort_by_key(uint64_t *keys,
+	size_t n,
+	void *const *vals,
+	const size_t *es,
+	int nvals,
+	int maxthreads,
+	int forkelem);
+
+int qsort_mt_ctx_sort_by_key(struct qsort_mt_ctx *ctx,
+	uint64_t *keys,
+	size_t n,
+	void *const *vals,
+	const size_t *es,
+	int nvals,
+	int forkelem);
@@ -0,0 +1,175 @@
+#pragma once
+
+/*
+ * Minimal hardware performance counter capture through perf_event_open(2),
+ * shared by the benchmark drivers.
+ *
+ * Every counter is opened as its own event rather than as a group, so that
+ * the kernel can multiplex them when the PMU has fewer counters than we
+ * ask for; values are scaled by time_enabled / time_running. Counters are
+ * inherited by threads created after perfev_open(), and the counts of
+ * those threads are folded into ours once they exit.
+ *
+ * Counters the kernel or the machine does not support (virtual machines,
+ * perf_event_paranoid, missing cache events) are left closed and reported
+ * as null; callers never need to check for failure.
+ */
+
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum perfev_counter {
+	PEV_CYCLES,
+	PEV_INSTRUCTIONS,
+	PEV_L1D_MISSES,
+	PEV_LLC_MISSES,
+	PEV_DTLB_MISSES,
+	PEV_BRANCH_MISSES,
+	PEV_NCOUNTERS
+};
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} perfev_events[PEV_NCOUNTERS] = {
+	[PEV_CYCLES] = {"cycles", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_CPU_CYCLES},
+	[PEV_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_INSTRUCTIONS},
+	[PEV_L1D_MISSES] = {"l1d_misses", PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	[PEV_LLC_MISSES] = {"llc_misses", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_CACHE_MISSES},
+	[PEV_DTLB_MISSES] = {"dtlb_misses", PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	[PEV_BRANCH_MISSES] = {"branch_misses", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+struct perfev {
+	int fd[PEV_NCOUNTERS]; /* -1 when unavailable */
+};
+
+struct perfev_sample {
+	bool valid[PEV_NCOUNTERS];
+	uint64_t v[PEV_NCOUNTERS];
+};
+
+/* returns the number of counters that could be opened */
+static inline int perfev_open(struct perfev *p)
+{
+	int n = 0;
+
+	for (int i = 0; i < PEV_NCOUNTERS; i++) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perfev_events[i].type;
+		attr.config = perfev_events[i].config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		p->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (p->fd[i] >= 0)
+			n++;
+	}
+	return n;
+}
+
+static inline void perfev_close(struct perfev *p)
+{
+	for (int i = 0; i < PEV_NCOUNTERS; i++)
+		if (p->fd[i] >= 0)
+			close(p->fd[i]);
+}
+
+static inline void perfev_start(struct perfev *p)
+{
+	for (int i = 0; i < PEV_NCOUNTERS; i++)
+		if (p->fd[i] >= 0) {
+			ioctl(p->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(p->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+}
+
+static inline void perfev_stop(struct perfev *p, struct perfev_sample *s)
+{
+	for (int i = 0; i < PEV_NCOUNTERS; i++)
+		if (p->fd[i] >= 0)
+			ioctl(p->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	for (int i = 0; i < PEV_NCOUNTERS; i++) {
+		/* value, time_enabled, time_running */
+		uint64_t buf[3];
+
+		s->valid[i] = p->fd[i] >= 0 &&
+			read(p->fd[i], buf, sizeof(buf)) == sizeof(buf) &&
+			buf[2] != 0;
+		if (!s->valid[i])
+			continue;
+
+		s->v[i] = buf[1] == buf[2]
+			? buf[0]
+			: (uint64_t) ((double) buf[0] * buf[1] / buf[2]);
+	}
+}
+
+/*
+ * Writes the sample as a JSON object; with nops > 0 every counter also
+ * gets a "<name>_per_op" entry.
+ */
+static inline void perfev_json(const struct perfev_sample *s, size_t nops,
+	FILE *f)
+{
+	fprintf(f, "{");
+	for (int i = 0; i < PEV_NCOUNTERS; i++) {
+		fprintf(f, "%s\"%s\": ", i ? ", " : "", perfev_events[i].name);
+		if (s->valid[i])
+			fprintf(f, "%llu", (unsigned long long) s->v[i]);
+		else
+			fprintf(f, "null");
+
+		if (!nops)
+			continue;
+		fprintf(f, ", \"%s_per_op\": ", perfev_events[i].name);
+		if (s->valid[i])
+			fprintf(f, "%.3f", (double) s->v[i] / nops);
+		else
+			fprintf(f, "null");
+	}
+	fprintf(f, "}");
+}
+
+/* one line of "name value per-op" triples, for the text-mode drivers */
+static inline void perfev_print(const char *phase,
+	const struct perfev_sample *s, size_t nops, FILE *f)
+{
+	fprintf(f, "%s:", phase);
+	for (int i = 0; i < PEV_NCOUNTERS; i++) {
+		if (!s->valid[i]) {
+			fprintf(f, " %s n/a", perfev_events[i].name);
+			continue;
+		}
+		fprintf(f, " %s %llu", perfev_events[i].name,
+			(unsigned long long) s->v[i]);
+		if (nops)
+			fprintf(f, " (%.3g/op)", (double) s->v[i] / nops);
+	}
+	fprintf(f, "\n");
+}
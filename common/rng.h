@@ -0,0 +1,67 @@
+#pragma once
+
+/*
+ * Random numbers for generating benchmark inputs, shared by the benchmark
+ * drivers: the splitmix64 PRNG (Steele, Lea & Flood), which is fast, needs
+ * a single word of state and so gives every generator its own stream, and
+ * a Zipf generator on top of it.
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* skew of the zipf distribution, the YCSB default */
+#define ZIPF_THETA 0.99
+
+static inline uint64_t splitmix64(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+/* uniform in [0, 1) */
+static inline double rand_unit(uint64_t *s)
+{
+	return (splitmix64(s) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Zipf generator from Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases", as used by YCSB. Rank 0 is the hottest item.
+ * Computing zeta(n) is O(n), but happens once outside the measurement.
+ */
+struct zipf {
+	size_t n;
+	double alpha, zetan, eta, half_pow_theta;
+};
+
+static inline void zipf_init(struct zipf *z, size_t n, double theta)
+{
+	double zeta2 = 1 + pow(0.5, theta);
+
+	z->n = n;
+	z->zetan = 0;
+	for (size_t i = 1; i <= n; i++)
+		z->zetan += 1 / pow(i, theta);
+	z->alpha = 1 / (1 - theta);
+	z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+	z->half_pow_theta = pow(0.5, theta);
+}
+
+static inline size_t zipf_next(struct zipf *z, uint64_t *s)
+{
+	double u = rand_unit(s);
+	double uz = u * z->zetan;
+
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + z->half_pow_theta)
+		return 1;
+
+	size_t r = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+	return r < z->n ? r : z->n - 1;
+}